@@ -5,14 +5,28 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -22,6 +36,21 @@
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_MAX_FPS 60
+#define KILO_MEM_BUDGET (256LL << 20)
+#define KILO_WRAP_CHUNK 65536
+#define ROWINDEX_BLOCK 512
+#define HEX_PROBE_SIZE 8192
+#define HEX_SEARCH_CHUNK (1 << 20)
+#define KILO_HEADLESS_ROWS 24
+#define KILO_HEADLESS_COLS 80
+
+#define SESSION_MAGIC "KILOREC1"
+
+#define SERVER_MSG_KEYS 'k'
+#define SERVER_MSG_WINSIZE 'w'
+#define SERVER_MAX_QUEUE (4 << 20)
+#define SERVER_PROMPT_IDLE 600
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -35,7 +64,8 @@ enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  RESIZE_EVENT
 };
 
 enum editorHighlight {
@@ -46,14 +76,29 @@ enum editorHighlight {
   HL_KEYWORD2,
   HL_STRING,
   HL_NUMBER,
-  HL_MATCH
+  HL_MATCH,
+  HL_CLASSES
 };
 
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+#define SYNCACHE_MAGIC "KILOSYN1"
+#define LINECACHE_MAGIC "KILOIDX1"
+#define LINECACHE_MIN_SIZE (1 << 20)
+#define LINECACHE_SAMPLES 64
+#define SYNTAX_FILE_EXT ".syn"
+
 /*** data ***/
 
+struct synKeyword {
+  uint32_t hash;
+  uint32_t str;
+  uint16_t len;
+  uint8_t hl;
+  uint8_t pad;
+};
+
 struct editorSyntax {
   char *filetype;
   char **filematch;
@@ -62,6 +107,99 @@ struct editorSyntax {
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+
+  const struct synKeyword *kwtable;
+  uint32_t kwmask;
+  const char *strings;
+  const unsigned char *separators;
+};
+
+struct editorMacro {
+  int *keys;
+  int nkeys;
+  int cap;
+  int recording;
+  int *queue;
+  int qlen;
+  int qpos;
+  int batch;
+  int lo;
+  int hi;
+};
+
+struct editorSession {
+  int recfd;
+  long long rec_last;
+  unsigned char *replay;
+  size_t replay_len;
+  size_t replay_pos;
+  int replay_paced;
+  long long replay_start;
+  long long replay_clock;
+  long long mark;
+  long long *latency;
+  int nlatency;
+  int latency_cap;
+  long long outbytes;
+  int headless;
+};
+
+struct editorClient {
+  int fd;
+  int dead;
+  unsigned char *msg;
+  int msglen;
+  char *keys;
+  int nkeys;
+  int keypos;
+  int screenrows;
+  int screencols;
+  int rowoff;
+  int coloff;
+  char *out;
+  int outlen;
+  int stale;
+  int idle;
+};
+
+struct editorServer {
+  int active;
+  int listenfd;
+  struct editorClient **clients;
+  int nclients;
+  struct editorClient *cur;
+};
+
+struct grepHit {
+  char *path;
+  int line;
+  int col;
+  char *text;
+  int textlen;
+};
+
+struct grepResults {
+  char *query;
+  struct grepHit *hits;
+  int nhits;
+};
+
+/* A theme is compiled into one ready-to-write SGR sequence per highlight
+ * class; `reset` returns the terminal to its default attributes. */
+struct editorTheme {
+  char sgr[HL_CLASSES][48];
+  int sgrlen[HL_CLASSES];
+  char reset[8];
+  int resetlen;
+  int plain_normal;
+};
+
+struct syntaxDB {
+  char *image;
+  size_t size;
+  int mapped;
+  int nsyntax;
+  struct editorSyntax *syntax;
 };
 
 typedef struct erow {
@@ -72,8 +210,65 @@ typedef struct erow {
   char *render;
   unsigned char *hl;
   int hl_open_comment;
+  int dirty;
+  long long orig_off;
+  int *matches;
+  int nmatches;
+  unsigned int match_gen;
+  int packed;
 } erow;
 
+struct fenwick {
+  long long *tree;
+  int len;
+  int cap;
+};
+
+struct rowBlock {
+  int n;
+  long long sum;
+  int vals[ROWINDEX_BLOCK];
+};
+
+struct rowIndex {
+  struct rowBlock **blocks;
+  int nblocks;
+  int cap;
+  int len;
+  struct fenwick counts;
+  struct fenwick sums;
+};
+
+/* A buffer in hex view has no rows; it is paged from fd on demand. */
+struct editorHex {
+  int fd;
+  long long top;
+  long long cur;
+};
+
+struct editorBuffer {
+  int cx, cy;
+  int rx;
+  int rowoff;
+  int coloff;
+  int numrows;
+  int rowcap;
+  erow *row;
+  char *arena;
+  struct rowIndex lineidx;
+  int dirty;
+  char *filename;
+  long long file_size;
+  struct timespec file_mtime;
+  struct editorSyntax *syntax;
+  struct grepResults *results;
+  struct editorHex hex;
+  int hex_force;
+  int loaded;
+  long long last_used;
+  long long mem;
+};
+
 struct editorConfig {
   int cx, cy;
   int rx;
@@ -82,12 +277,46 @@ struct editorConfig {
   int screenrows;
   int screencols;
   int numrows;
+  int rowcap;
   erow *row;
+  char *arena;
+  struct rowIndex lineidx;
   int dirty;
   char *filename;
-  char statusmsg[80];
+  long long file_size;
+  struct timespec file_mtime;
+  char statusmsg[256];
   time_t statusmsg_time;
   struct editorSyntax *syntax;
+  struct grepResults *results;
+  struct editorHex hex;
+  int hex_force;
+  long long frame_hextop;
+  char *match_query;
+  int match_all;
+  unsigned int match_gen;
+  struct editorBuffer *buffers;
+  int nbuffers;
+  int curbuf;
+  long long buffer_clock;
+  long long mem_budget;
+  struct syntaxDB syntaxdb;
+  struct editorTheme theme;
+  int fullredraw;
+  int frame_rowoff;
+  int frame_coloff;
+  long long frame_vrowoff;
+  int softwrap;
+  struct rowIndex wrapidx;
+  int wrapcols;
+  long long vrowoff;
+  long long vcursor;
+  int vcursor_col;
+  long long frame_interval;
+  struct editorSession session;
+  struct editorMacro macro;
+  struct editorServer server;
+  int winchpipe[2];
   struct termios orig_termios;
 };
 
@@ -110,7 +339,8 @@ struct editorSyntax HLDB[] = {
     C_HL_extensions,
     C_HL_keywords,
     "//", "/*", "*/",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    NULL, 0, NULL, NULL
   },
 };
 
@@ -120,7 +350,18 @@ struct editorSyntax HLDB[] = {
 
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
+void editorProcessKeypress();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+struct editorSyntax *syntaxDBMatch(struct syntaxDB *db, const char *filename);
+int editorReadByte(char *c);
+void editorUpdateRow(erow *row);
+void editorRowHighlight(erow *row);
+void editorWrapRowChanged(erow *row);
+void editorFileStat(int fd);
+int editorHexProbe(const char *filename);
+void editorMacroRowsShifted(int at, int delta);
+void editorHexOpen();
+void editorServerWrite(const char *s, int len);
 
 /*** terminal ***/
 
@@ -152,22 +393,81 @@ void enableRawMode() {
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
 }
 
-int editorReadKey() {
+long long editorNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* SIGWINCH only writes a byte to a self-pipe; the input loop picks it up
+ * as a RESIZE_EVENT key, so a burst of signals collapses into one. */
+
+void editorWinchHandler(int sig) {
+  (void)sig;
+  int saved = errno;
+  write(E.winchpipe[1], "w", 1);
+  errno = saved;
+}
+
+void editorWinchInit() {
+  if (pipe(E.winchpipe) == -1) die("pipe");
+  for (int i = 0; i < 2; i++) {
+    fcntl(E.winchpipe[i], F_SETFL, O_NONBLOCK);
+    fcntl(E.winchpipe[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorWinchHandler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+}
+
+/* Drains the self-pipe and returns whether any resize was signalled. */
+int editorWinchPending() {
+  if (E.winchpipe[0] == -1) return 0;
+  char buf[64];
+  int pending = 0;
+  while (read(E.winchpipe[0], buf, sizeof(buf)) > 0) pending = 1;
+  return pending;
+}
+
+/* Blocks until the terminal has input or the window was resized. Returns 1
+ * on resize. */
+int editorWaitInput() {
+  if (E.winchpipe[0] == -1 || E.server.cur) return 0;
+  while (1) {
+    struct pollfd pfds[2] = {
+      { STDIN_FILENO, POLLIN, 0 },
+      { E.winchpipe[0], POLLIN, 0 }
+    };
+    if (poll(pfds, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      die("poll");
+    }
+    if ((pfds[1].revents & POLLIN) && editorWinchPending()) return 1;
+    if (pfds[0].revents) return 0;
+  }
+}
+
+int editorReadTerminalKey() {
   int nread;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+  if (editorWaitInput()) return RESIZE_EVENT;
+  while ((nread = editorReadByte(&c)) != 1) {
     if (nread == -1 && errno != EAGAIN) die("read");
   }
 
   if (c == '\x1b') {
     char seq[3];
 
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    if (editorReadByte(&seq[0]) != 1) return '\x1b';
+    if (editorReadByte(&seq[1]) != 1) return '\x1b';
 
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+        if (editorReadByte(&seq[2]) != 1) return '\x1b';
         if (seq[2] == '~') {
           switch (seq[1]) {
             case '1': return HOME_KEY;
@@ -209,9 +509,12 @@ int getCursorPosition(int *rows, int *cols) {
   if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
   while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
-    if (buf[i] == 'R') break;
-    i++;
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    if (poll(&pfd, 1, 1000) <= 0) break;
+    ssize_t n = read(STDIN_FILENO, &buf[i], sizeof(buf) - 1 - i);
+    if (n <= 0) break;
+    i += n;
+    if (memchr(buf, 'R', i)) break;
   }
   buf[i] = '\0';
 
@@ -234,19 +537,228 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
+/*** session recording ***/
+
+/* A session file is SESSION_MAGIC followed by one record per key: the
+ * microseconds since the previous key and the key code, both as LEB128
+ * varints. */
+
+void sessionPutVarint(unsigned long long v, unsigned char *buf, int *len) {
+  do {
+    unsigned char b = v & 0x7f;
+    v >>= 7;
+    buf[(*len)++] = b | (v ? 0x80 : 0);
+  } while (v);
+}
+
+int sessionGetVarint(struct editorSession *ss, size_t *pos,
+                     unsigned long long *v) {
+  int shift = 0;
+  *v = 0;
+  while (*pos < ss->replay_len && shift < 64) {
+    unsigned char b = ss->replay[(*pos)++];
+    *v |= (unsigned long long)(b & 0x7f) << shift;
+    if (!(b & 0x80)) return 1;
+    shift += 7;
+  }
+  return 0;
+}
+
+void editorRecordStart(const char *path) {
+  E.session.recfd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (E.session.recfd == -1) die("open");
+  if (write(E.session.recfd, SESSION_MAGIC, 8) != 8) die("write");
+  E.session.rec_last = editorNow();
+}
+
+void editorRecordKey(int key) {
+  unsigned char buf[20];
+  int len = 0;
+  long long now = editorNow();
+  sessionPutVarint(now - E.session.rec_last, buf, &len);
+  sessionPutVarint(key, buf, &len);
+  E.session.rec_last = now;
+  if (write(E.session.recfd, buf, len) != len) die("write");
+}
+
+int editorLatencyCompare(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+void editorReplayReport() {
+  struct editorSession *ss = &E.session;
+  int n = ss->nlatency;
+  if (ss->replay == NULL) return;
+
+  long long total = 0;
+  for (int i = 0; i < n; i++) total += ss->latency[i];
+  qsort(ss->latency, n, sizeof(long long), editorLatencyCompare);
+
+  fprintf(stderr, "replay: %d events in %.3f s, %lld bytes of output\n",
+          n, (editorNow() - ss->replay_start) / 1e6, ss->outbytes);
+  if (n == 0) return;
+  fprintf(stderr, "latency (us): mean %lld  p50 %lld  p90 %lld  p99 %lld  "
+          "max %lld\n", total / n, ss->latency[n / 2],
+          ss->latency[(int)(n * 0.9)], ss->latency[(int)(n * 0.99)],
+          ss->latency[n - 1]);
+}
+
+void editorReplayStart(const char *path, int paced) {
+  struct editorSession *ss = &E.session;
+  FILE *fp = fopen(path, "rb");
+  if (!fp) die("fopen");
+
+  size_t cap = 4096;
+  ss->replay = malloc(cap);
+  size_t n;
+  while ((n = fread(&ss->replay[ss->replay_len], 1, cap - ss->replay_len,
+                    fp)) > 0) {
+    ss->replay_len += n;
+    if (ss->replay_len == cap) {
+      cap *= 2;
+      ss->replay = realloc(ss->replay, cap);
+    }
+  }
+  fclose(fp);
+
+  if (ss->replay_len < 8 || memcmp(ss->replay, SESSION_MAGIC, 8)) {
+    errno = EINVAL;
+    die("replay");
+  }
+  ss->replay_pos = 8;
+  ss->replay_paced = paced;
+  ss->headless = 1;
+  ss->replay_start = editorNow();
+  atexit(editorReplayReport);
+}
+
+/* Returns the time at which the next replayed key is due, or -1 when the
+ * session is exhausted. */
+long long editorReplayDue(size_t *pos, int *key) {
+  struct editorSession *ss = &E.session;
+  unsigned long long delta, k;
+  if (!sessionGetVarint(ss, pos, &delta) || !sessionGetVarint(ss, pos, &k))
+    return -1;
+  *key = k;
+  if (!ss->replay_paced) return 0;
+  return ss->replay_start + ss->replay_clock + delta;
+}
+
+int editorReplayKey() {
+  struct editorSession *ss = &E.session;
+  long long now = editorNow();
+
+  if (ss->mark) {
+    if (ss->nlatency == ss->latency_cap) {
+      ss->latency_cap = ss->latency_cap ? ss->latency_cap * 2 : 1024;
+      ss->latency = realloc(ss->latency, sizeof(long long) * ss->latency_cap);
+    }
+    ss->latency[ss->nlatency++] = now - ss->mark;
+  }
+
+  int key;
+  long long due = editorReplayDue(&ss->replay_pos, &key);
+  if (due == -1) exit(0);
+  if (due > now) {
+    struct timespec ts;
+    ts.tv_sec = (due - now) / 1000000;
+    ts.tv_nsec = (due - now) % 1000000 * 1000;
+    nanosleep(&ts, NULL);
+  }
+  if (ss->replay_paced) ss->replay_clock = due - ss->replay_start;
+
+  ss->mark = editorNow();
+  return key;
+}
+
+int editorReplayPending() {
+  size_t pos = E.session.replay_pos;
+  int key;
+  long long due = editorReplayDue(&pos, &key);
+  return due != -1 && due <= editorNow();
+}
+
+int editorReadKey() {
+  struct editorMacro *m = &E.macro;
+  if (m->qpos < m->qlen) return m->queue[m->qpos++];
+  /* a macro that ends inside a prompt cancels it */
+  if (m->batch) return '\x1b';
+
+  int c;
+  if (E.session.replay) {
+    c = editorReplayKey();
+  } else {
+    c = editorReadTerminalKey();
+    if (E.session.recfd != -1 && c != RESIZE_EVENT) editorRecordKey(c);
+  }
+
+  if (m->recording && c != RESIZE_EVENT && c != CTRL_KEY('r') &&
+      c != CTRL_KEY('p')) {
+    if (m->nkeys == m->cap) {
+      m->cap = m->cap ? m->cap * 2 : 64;
+      m->keys = realloc(m->keys, sizeof(int) * m->cap);
+    }
+    m->keys[m->nkeys++] = c;
+  }
+  return c;
+}
+
+void editorOutput(const char *s, int len) {
+  if (E.server.cur) {
+    editorServerWrite(s, len);
+    return;
+  }
+  if (E.session.headless) {
+    E.session.outbytes += len;
+    return;
+  }
+  write(STDOUT_FILENO, s, len);
+}
+
 /*** syntax highlighting ***/
 
 int is_separator(int c) {
   return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
+uint32_t syntaxHash(const char *s, int len) {
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+int editorSyntaxKeyword(struct editorSyntax *s, const char *word, int len) {
+  uint32_t h = syntaxHash(word, len);
+  uint32_t i;
+  for (i = h & s->kwmask; s->kwtable[i].len; i = (i + 1) & s->kwmask) {
+    const struct synKeyword *kw = &s->kwtable[i];
+    if (kw->hash == h && kw->len == len &&
+        !memcmp(&s->strings[kw->str], word, len))
+      return kw->hl;
+  }
+  return HL_NORMAL;
+}
+
 void editorUpdateSyntax(erow *row) {
   row->hl = realloc(row->hl, row->rsize);
   memset(row->hl, HL_NORMAL, row->rsize);
+  E.fullredraw = 1;
+
+  /* while a macro batch runs, just note the row; it is highlighted once
+   * when the batch finishes */
+  if (E.macro.batch == 1) {
+    if (E.macro.lo == -1 || row->idx < E.macro.lo) E.macro.lo = row->idx;
+    if (row->idx > E.macro.hi) E.macro.hi = row->idx;
+    return;
+  }
 
   if (E.syntax == NULL) return;
 
-  char **keywords = E.syntax->keywords;
+  const unsigned char *sep = E.syntax->separators;
 
   char *scs = E.syntax->singleline_comment_start;
   char *mcs = E.syntax->multiline_comment_start;
@@ -326,73 +838,488 @@ void editorUpdateSyntax(erow *row) {
     }
 
     if (prev_sep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2) klen--;
-
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
+      int klen = 0;
+      while (!sep[(unsigned char)row->render[i + klen]]) klen++;
+      int kw = klen ? editorSyntaxKeyword(E.syntax, &row->render[i], klen)
+                    : HL_NORMAL;
+      if (kw != HL_NORMAL) {
+        memset(&row->hl[i], kw, klen);
+        i += klen;
         prev_sep = 0;
         continue;
       }
     }
 
-    prev_sep = is_separator(c);
+    prev_sep = sep[(unsigned char)c];
     i++;
   }
 
   int changed = (row->hl_open_comment != in_comment);
   row->hl_open_comment = in_comment;
+  if (E.macro.batch) return;
   if (changed && row->idx + 1 < E.numrows)
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+    editorRowHighlight(&E.row[row->idx + 1]);
+}
+
+/* Rows loaded from the line cache have no render or hl until first needed;
+ * their hl_open_comment comes from the cache. */
+void editorRowHighlight(erow *row) {
+  if (row->render == NULL) editorUpdateRow(row);
+  else editorUpdateSyntax(row);
+}
+
+void editorRowRender(erow *row) {
+  if (row->render == NULL) editorUpdateRow(row);
+}
+
+/*** themes ***/
+
+/* A theme file holds one line per highlight class:
+ *
+ *   keyword1 fg=214 bold
+ *   comment  fg=#6a9955 bg=default
+ *   match    fg=black bg=yellow underline
+ *
+ * Colors are one of the eight ANSI names, a 256-color index or #rrggbb.
+ * Classes left out keep the default theme's style. */
+
+#define THEME_DEFAULT -1
+#define THEME_NAMED 256
+#define THEME_RGB 0x1000000
+
+struct themeStyle {
+  int fg;
+  int bg;
+  int bold;
+  int underline;
+};
+
+static const char *themeClassNames[HL_CLASSES] = {
+  "normal", "comment", "mlcomment", "keyword1", "keyword2", "string",
+  "number", "match"
+};
+
+static const char *themeColorNames[8] = {
+  "black", "red", "green", "yellow", "blue", "magenta", "cyan", "white"
+};
+
+static const struct themeStyle themeDefault[HL_CLASSES] = {
+  { THEME_DEFAULT, THEME_DEFAULT, 0, 0 },
+  { THEME_NAMED + 6, THEME_DEFAULT, 0, 0 },
+  { THEME_NAMED + 6, THEME_DEFAULT, 0, 0 },
+  { THEME_NAMED + 3, THEME_DEFAULT, 0, 0 },
+  { THEME_NAMED + 2, THEME_DEFAULT, 0, 0 },
+  { THEME_NAMED + 5, THEME_DEFAULT, 0, 0 },
+  { THEME_NAMED + 1, THEME_DEFAULT, 0, 0 },
+  { THEME_NAMED + 4, THEME_DEFAULT, 0, 0 }
+};
+
+/* Returns 0 and stores the color on success, -1 if `s` is not a color. */
+int themeParseColor(const char *s, int *color) {
+  if (!strcmp(s, "default")) {
+    *color = THEME_DEFAULT;
+    return 0;
+  }
+  for (int i = 0; i < 8; i++) {
+    if (!strcmp(s, themeColorNames[i])) {
+      *color = THEME_NAMED + i;
+      return 0;
+    }
+  }
+  char *end;
+  if (s[0] == '#' && strlen(s) == 7) {
+    long rgb = strtol(&s[1], &end, 16);
+    if (*end != '\0') return -1;
+    *color = THEME_RGB | rgb;
+    return 0;
+  }
+  long idx = strtol(s, &end, 10);
+  if (*end != '\0' || end == s || idx < 0 || idx > 255) return -1;
+  *color = idx;
+  return 0;
+}
+
+void themeParseFile(const char *path, struct themeStyle *styles) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) return;
+
+  char *line = NULL;
+  size_t linecap = 0;
+  while (getline(&line, &linecap, fp) != -1) {
+    char *key = strtok(line, " \t\r\n");
+    if (key == NULL || key[0] == '#') continue;
+
+    int cls;
+    for (cls = 0; cls < HL_CLASSES; cls++)
+      if (!strcmp(key, themeClassNames[cls])) break;
+    if (cls == HL_CLASSES) continue;
+
+    struct themeStyle st = { THEME_DEFAULT, THEME_DEFAULT, 0, 0 };
+    char *val;
+    while ((val = strtok(NULL, " \t\r\n")) != NULL) {
+      if (!strncmp(val, "fg=", 3)) themeParseColor(&val[3], &st.fg);
+      else if (!strncmp(val, "bg=", 3)) themeParseColor(&val[3], &st.bg);
+      else if (!strcmp(val, "bold")) st.bold = 1;
+      else if (!strcmp(val, "underline")) st.underline = 1;
+    }
+    styles[cls] = st;
+  }
+  free(line);
+  fclose(fp);
+}
+
+int themeAppendColor(char *buf, int len, int color, int base) {
+  if (color >= THEME_RGB) {
+    return len + sprintf(&buf[len], ";%d;2;%d;%d;%d", base + 8,
+                         (color >> 16) & 0xff, (color >> 8) & 0xff,
+                         color & 0xff);
+  } else if (color >= THEME_NAMED) {
+    return len + sprintf(&buf[len], ";%d", base + color - THEME_NAMED);
+  } else if (color >= 0) {
+    return len + sprintf(&buf[len], ";%d;5;%d", base + 8, color);
+  }
+  return len;
 }
 
-int editorSyntaxToColor(int hl) {
-  switch (hl) {
-    case HL_COMMENT:
-    case HL_MLCOMMENT: return 36;
-    case HL_KEYWORD1: return 33;
-    case HL_KEYWORD2: return 32;
-    case HL_STRING: return 35;
-    case HL_NUMBER: return 31;
-    case HL_MATCH: return 34;
-    default: return 37;
+/* If no class uses a background or attributes, each sequence only sets the
+ * foreground, so the default theme writes exactly the classic 3x codes.
+ * Otherwise every sequence starts from a full reset. */
+void themeCompile(struct editorTheme *t, const struct themeStyle *styles) {
+  int full = 0;
+  int cls;
+  for (cls = 0; cls < HL_CLASSES; cls++) {
+    if (styles[cls].bg != THEME_DEFAULT || styles[cls].bold ||
+        styles[cls].underline)
+      full = 1;
   }
+
+  for (cls = 0; cls < HL_CLASSES; cls++) {
+    const struct themeStyle *st = &styles[cls];
+    char *buf = t->sgr[cls];
+    int len = sprintf(buf, "\x1b[%s", full ? "0" : "");
+    if (st->bold) len += sprintf(&buf[len], ";1");
+    if (st->underline) len += sprintf(&buf[len], ";4");
+    if (!full && st->fg == THEME_DEFAULT) len += sprintf(&buf[len], ";39");
+    len = themeAppendColor(buf, len, st->fg, 30);
+    len = themeAppendColor(buf, len, st->bg, 40);
+    if (!full) {
+      /* drop the separator left in front of the only parameter */
+      memmove(&buf[2], &buf[3], len - 2);
+      len--;
+    }
+    buf[len++] = 'm';
+    buf[len] = '\0';
+    t->sgrlen[cls] = len;
+  }
+
+  strcpy(t->reset, full ? "\x1b[0m" : "\x1b[39m");
+  t->resetlen = strlen(t->reset);
+  t->plain_normal = styles[HL_NORMAL].fg == THEME_DEFAULT &&
+                    styles[HL_NORMAL].bg == THEME_DEFAULT &&
+                    !styles[HL_NORMAL].bold && !styles[HL_NORMAL].underline;
+}
+
+/* Loads $KILO_THEME, or ~/.kilo/theme if it exists, over the default. */
+void editorThemeLoad() {
+  struct themeStyle styles[HL_CLASSES];
+  memcpy(styles, themeDefault, sizeof(styles));
+
+  char path[4096];
+  const char *env = getenv("KILO_THEME");
+  const char *home = getenv("HOME");
+  if (env) themeParseFile(env, styles);
+  else if (home) {
+    snprintf(path, sizeof(path), "%s/.kilo/theme", home);
+    themeParseFile(path, styles);
+  }
+
+  themeCompile(&E.theme, styles);
 }
 
 void editorSelectSyntaxHighlight() {
   E.syntax = NULL;
   if (E.filename == NULL) return;
 
-  char *ext = strrchr(E.filename, '.');
+  E.syntax = syntaxDBMatch(&E.syntaxdb, E.filename);
+  if (E.syntax == NULL) return;
 
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-    struct editorSyntax *s = &HLDB[j];
-    unsigned int i = 0;
-    while (s->filematch[i]) {
-      int is_ext = (s->filematch[i][0] == '.');
-      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-          (!is_ext && strstr(E.filename, s->filematch[i]))) {
-        E.syntax = s;
+  int filerow;
+  for (filerow = 0; filerow < E.numrows; filerow++) {
+    editorRowHighlight(&E.row[filerow]);
+  }
+}
 
-        int filerow;
-        for (filerow = 0; filerow < E.numrows; filerow++) {
-          editorUpdateSyntax(&E.row[filerow]);
-        }
+/*** line index ***/
 
-        return;
+void fenwickReserve(struct fenwick *f, int n) {
+  if (n + 1 <= f->cap) return;
+  int cap = f->cap ? f->cap : 64;
+  while (cap < n + 1) cap *= 2;
+  f->tree = realloc(f->tree, sizeof(long long) * cap);
+  if (f->tree == NULL) die("realloc");
+  f->cap = cap;
+}
+
+void fenwickTruncate(struct fenwick *f, int len) {
+  if (len < f->len) f->len = len;
+}
+
+/* Turns the raw values stored in tree[from+1..n] into a valid tree, assuming
+ * the first `from` nodes are already valid. Linear in n - from. */
+void fenwickBuild(struct fenwick *f, int from, int n) {
+  int i;
+  for (i = from; i > 0; i -= i & -i) {
+    int p = i + (i & -i);
+    if (p > from && p <= n) f->tree[p] += f->tree[i];
+  }
+  for (i = from + 1; i <= n; i++) {
+    int p = i + (i & -i);
+    if (p <= n) f->tree[p] += f->tree[i];
+  }
+  f->len = n;
+}
+
+void fenwickAdd(struct fenwick *f, int idx, long long delta) {
+  for (int i = idx + 1; i <= f->len; i += i & -i) f->tree[i] += delta;
+}
+
+long long fenwickPrefix(struct fenwick *f, int n) {
+  long long sum = 0;
+  if (n > f->len) n = f->len;
+  for (int i = n; i > 0; i -= i & -i) sum += f->tree[i];
+  return sum;
+}
+
+/* Returns the index of the element containing position `target`, or f->len
+ * if target is past the end. */
+int fenwickSearch(struct fenwick *f, long long target) {
+  int pos = 0;
+  int step = 1;
+  while (step * 2 <= f->len) step *= 2;
+  for (; step > 0; step /= 2) {
+    if (pos + step <= f->len && f->tree[pos + step] <= target) {
+      pos += step;
+      target -= f->tree[pos];
+    }
+  }
+  return pos;
+}
+
+/* A row index keeps one small value per row (bytes for E.lineidx, screen
+ * lines for E.wrapidx) in blocks of up to ROWINDEX_BLOCK values, with
+ * Fenwick trees over the per-block counts and sums. Inserting or deleting
+ * a row only shifts values inside its block. Splitting or dropping a block
+ * truncates the trees at that block, and the next query rebuilds the tail
+ * from the block totals, which is linear in blocks rather than rows.
+ * Queries find the block in O(log n) and then scan within it. */
+
+void rowIndexSync(struct rowIndex *ix) {
+  int from = ix->sums.len;
+  if (from == ix->nblocks) return;
+  fenwickReserve(&ix->counts, ix->nblocks);
+  fenwickReserve(&ix->sums, ix->nblocks);
+  for (int j = from; j < ix->nblocks; j++) {
+    ix->counts.tree[j + 1] = ix->blocks[j]->n;
+    ix->sums.tree[j + 1] = ix->blocks[j]->sum;
+  }
+  fenwickBuild(&ix->counts, from, ix->nblocks);
+  fenwickBuild(&ix->sums, from, ix->nblocks);
+}
+
+void rowIndexInvalidate(struct rowIndex *ix, int b) {
+  fenwickTruncate(&ix->counts, b);
+  fenwickTruncate(&ix->sums, b);
+}
+
+struct rowBlock *rowIndexAddBlock(struct rowIndex *ix, int b) {
+  if (ix->nblocks == ix->cap) {
+    ix->cap = ix->cap ? ix->cap * 2 : 16;
+    ix->blocks = realloc(ix->blocks, sizeof(struct rowBlock *) * ix->cap);
+  }
+  memmove(&ix->blocks[b + 1], &ix->blocks[b],
+          sizeof(struct rowBlock *) * (ix->nblocks - b));
+  struct rowBlock *blk = malloc(sizeof(struct rowBlock));
+  if (blk == NULL) die("malloc");
+  blk->n = 0;
+  blk->sum = 0;
+  ix->blocks[b] = blk;
+  ix->nblocks++;
+  rowIndexInvalidate(ix, b);
+  return blk;
+}
+
+void rowIndexDropBlock(struct rowIndex *ix, int b) {
+  free(ix->blocks[b]);
+  memmove(&ix->blocks[b], &ix->blocks[b + 1],
+          sizeof(struct rowBlock *) * (ix->nblocks - b - 1));
+  ix->nblocks--;
+  rowIndexInvalidate(ix, b);
+}
+
+/* Returns the block holding element `at` and its position in *off; `at`
+ * equal to the length maps to the end of the last block. */
+int rowIndexLocate(struct rowIndex *ix, int at, int *off) {
+  int last = ix->nblocks - 1;
+  if (at >= ix->len - ix->blocks[last]->n) {
+    *off = at - (ix->len - ix->blocks[last]->n);
+    return last;
+  }
+  rowIndexSync(ix);
+  int b = fenwickSearch(&ix->counts, at);
+  *off = at - fenwickPrefix(&ix->counts, b);
+  return b;
+}
+
+void rowIndexInsert(struct rowIndex *ix, int at, int v) {
+  if (ix->nblocks == 0) rowIndexAddBlock(ix, 0);
+  int off;
+  int b = rowIndexLocate(ix, at, &off);
+  struct rowBlock *blk = ix->blocks[b];
+
+  if (blk->n == ROWINDEX_BLOCK) {
+    if (off == blk->n) {
+      /* appending: start a new block rather than leave two half full */
+      blk = rowIndexAddBlock(ix, ++b);
+      off = 0;
+    } else {
+      struct rowBlock *next = rowIndexAddBlock(ix, b + 1);
+      int half = blk->n / 2;
+      next->n = blk->n - half;
+      memcpy(next->vals, &blk->vals[half], sizeof(int) * next->n);
+      for (int i = 0; i < next->n; i++) next->sum += next->vals[i];
+      blk->n = half;
+      blk->sum -= next->sum;
+      rowIndexInvalidate(ix, b);
+      if (off > half) {
+        blk = next;
+        off -= half;
+        b++;
       }
-      i++;
     }
   }
+
+  memmove(&blk->vals[off + 1], &blk->vals[off], sizeof(int) * (blk->n - off));
+  blk->vals[off] = v;
+  blk->n++;
+  blk->sum += v;
+  ix->len++;
+  fenwickAdd(&ix->counts, b, 1);
+  fenwickAdd(&ix->sums, b, v);
+}
+
+void rowIndexDelete(struct rowIndex *ix, int at) {
+  if (at < 0 || at >= ix->len) return;
+  int off;
+  int b = rowIndexLocate(ix, at, &off);
+  struct rowBlock *blk = ix->blocks[b];
+  int v = blk->vals[off];
+  memmove(&blk->vals[off], &blk->vals[off + 1],
+          sizeof(int) * (blk->n - off - 1));
+  blk->n--;
+  blk->sum -= v;
+  ix->len--;
+
+  if (blk->n == 0) {
+    rowIndexDropBlock(ix, b);
+  } else if (b + 1 < ix->nblocks && blk->n < ROWINDEX_BLOCK / 4 &&
+             blk->n + ix->blocks[b + 1]->n <= ROWINDEX_BLOCK) {
+    struct rowBlock *next = ix->blocks[b + 1];
+    memcpy(&blk->vals[blk->n], next->vals, sizeof(int) * next->n);
+    blk->n += next->n;
+    blk->sum += next->sum;
+    rowIndexDropBlock(ix, b + 1);
+    rowIndexInvalidate(ix, b);
+  } else {
+    fenwickAdd(&ix->counts, b, -1);
+    fenwickAdd(&ix->sums, b, -v);
+  }
+}
+
+void rowIndexAdd(struct rowIndex *ix, int at, int delta) {
+  if (at < 0 || at >= ix->len) return;
+  int off;
+  int b = rowIndexLocate(ix, at, &off);
+  ix->blocks[b]->vals[off] += delta;
+  ix->blocks[b]->sum += delta;
+  fenwickAdd(&ix->sums, b, delta);
+}
+
+int rowIndexGet(struct rowIndex *ix, int at) {
+  int off;
+  int b = rowIndexLocate(ix, at, &off);
+  return ix->blocks[b]->vals[off];
+}
+
+/* Sum of the first n values. */
+long long rowIndexPrefix(struct rowIndex *ix, int n) {
+  if (n <= 0 || ix->nblocks == 0) return 0;
+  rowIndexSync(ix);
+  if (n >= ix->len) return fenwickPrefix(&ix->sums, ix->nblocks);
+
+  int off;
+  int b = rowIndexLocate(ix, n, &off);
+  struct rowBlock *blk = ix->blocks[b];
+  long long sum = fenwickPrefix(&ix->sums, b);
+  int i;
+  if (off <= blk->n / 2) {
+    for (i = 0; i < off; i++) sum += blk->vals[i];
+  } else {
+    sum += blk->sum;
+    for (i = off; i < blk->n; i++) sum -= blk->vals[i];
+  }
+  return sum;
+}
+
+/* Returns the index of the element containing position `target`, or the
+ * length if target is past the end. Values must be positive. */
+int rowIndexSearch(struct rowIndex *ix, long long target) {
+  if (ix->nblocks == 0) return 0;
+  rowIndexSync(ix);
+  int b = fenwickSearch(&ix->sums, target);
+  if (b >= ix->nblocks) return ix->len;
+  long long rem = target - fenwickPrefix(&ix->sums, b);
+  struct rowBlock *blk = ix->blocks[b];
+  int i = 0;
+  while (i < blk->n && rem >= blk->vals[i]) rem -= blk->vals[i++];
+  return fenwickPrefix(&ix->counts, b) + i;
+}
+
+void rowIndexClear(struct rowIndex *ix) {
+  for (int j = 0; j < ix->nblocks; j++) free(ix->blocks[j]);
+  ix->nblocks = 0;
+  ix->len = 0;
+  rowIndexInvalidate(ix, 0);
+}
+
+void rowIndexFree(struct rowIndex *ix) {
+  rowIndexClear(ix);
+  free(ix->blocks);
+  free(ix->counts.tree);
+  free(ix->sums.tree);
+  memset(ix, 0, sizeof(*ix));
+}
+
+/* Replaces the contents with n values in full blocks; the caller fills in
+ * vals and sum of every block. */
+void rowIndexReset(struct rowIndex *ix, int n) {
+  rowIndexClear(ix);
+  while (ix->len < n) {
+    struct rowBlock *blk = rowIndexAddBlock(ix, ix->nblocks);
+    blk->n = n - ix->len < ROWINDEX_BLOCK ? n - ix->len : ROWINDEX_BLOCK;
+    ix->len += blk->n;
+  }
+}
+
+void editorIndexRowResized(erow *row, int delta) {
+  rowIndexAdd(&E.lineidx, row->idx, delta);
+}
+
+long long editorRowOffset(int at) {
+  return rowIndexPrefix(&E.lineidx, at);
+}
+
+int editorOffsetToRow(long long offset) {
+  return rowIndexSearch(&E.lineidx, offset);
 }
 
 /*** row operations ***/
@@ -443,12 +1370,36 @@ void editorUpdateRow(erow *row) {
   row->rsize = idx;
 
   editorUpdateSyntax(row);
+  editorWrapRowChanged(row);
+  row->match_gen = 0;
+}
+
+/* Grows E.row geometrically; editorCompact shrinks it back to fit. */
+void editorRowsReserve(int n) {
+  if (n <= E.rowcap) return;
+  int cap = E.rowcap ? E.rowcap * 2 : 64;
+  while (cap < n) cap *= 2;
+  E.row = realloc(E.row, sizeof(erow) * cap);
+  E.rowcap = cap;
+}
+
+/* Rows packed by editorCompact share E.arena; give a row its own chars
+ * before it is resized. */
+void editorRowUnpack(erow *row) {
+  if (!row->packed) return;
+  char *chars = malloc(row->size + 1);
+  memcpy(chars, row->chars, row->size + 1);
+  row->chars = chars;
+  row->packed = 0;
 }
 
 void editorInsertRow(int at, char *s, size_t len) {
   if (at < 0 || at > E.numrows) return;
 
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+  editorRowsReserve(E.numrows + 1);
+  rowIndexInsert(&E.lineidx, at, len + 1);
+  if (E.wrapcols) rowIndexInsert(&E.wrapidx, at, 1);
+  editorMacroRowsShifted(at, 1);
   memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
   for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
 
@@ -463,6 +1414,12 @@ void editorInsertRow(int at, char *s, size_t len) {
   E.row[at].render = NULL;
   E.row[at].hl = NULL;
   E.row[at].hl_open_comment = 0;
+  E.row[at].dirty = 1;
+  E.row[at].orig_off = -1;
+  E.row[at].matches = NULL;
+  E.row[at].nmatches = 0;
+  E.row[at].match_gen = 0;
+  E.row[at].packed = 0;
   editorUpdateRow(&E.row[at]);
 
   E.numrows++;
@@ -471,35 +1428,46 @@ void editorInsertRow(int at, char *s, size_t len) {
 
 void editorFreeRow(erow *row) {
   free(row->render);
-  free(row->chars);
+  if (!row->packed) free(row->chars);
   free(row->hl);
+  free(row->matches);
 }
 
 void editorDelRow(int at) {
   if (at < 0 || at >= E.numrows) return;
   editorFreeRow(&E.row[at]);
+  rowIndexDelete(&E.lineidx, at);
+  if (E.wrapcols) rowIndexDelete(&E.wrapidx, at);
+  editorMacroRowsShifted(at, -1);
   memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
   for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
   E.numrows--;
+  E.fullredraw = 1;
   E.dirty++;
 }
 
 void editorRowInsertChar(erow *row, int at, int c) {
   if (at < 0 || at > row->size) at = row->size;
+  editorRowUnpack(row);
   row->chars = realloc(row->chars, row->size + 2);
   memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
   row->size++;
   row->chars[at] = c;
+  editorIndexRowResized(row, 1);
   editorUpdateRow(row);
+  row->dirty = 1;
   E.dirty++;
 }
 
 void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorRowUnpack(row);
   row->chars = realloc(row->chars, row->size + len + 1);
   memcpy(&row->chars[row->size], s, len);
   row->size += len;
   row->chars[row->size] = '\0';
+  editorIndexRowResized(row, len);
   editorUpdateRow(row);
+  row->dirty = 1;
   E.dirty++;
 }
 
@@ -507,29 +1475,146 @@ void editorRowDelChar(erow *row, int at) {
   if (at < 0 || at >= row->size) return;
   memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
   row->size--;
+  editorIndexRowResized(row, -1);
   editorUpdateRow(row);
+  row->dirty = 1;
   E.dirty++;
 }
 
-/*** editor operations ***/
+/*** soft wrap ***/
 
-void editorInsertChar(int c) {
-  if (E.cy == E.numrows) {
-    editorInsertRow(E.numrows, "", 0);
+/* In soft-wrap mode each row takes ceil(width / screencols) screen lines,
+ * at least one. E.wrapidx holds those counts for E.wrapcols columns and is
+ * kept up to date by the row operations once built; E.wrapcols == 0 means
+ * it is not built. It is rebuilt in parallel when the width changes. */
+
+int editorRowWraps(erow *row, int cols) {
+  int width = row->render ? row->rsize : editorRowCxToRx(row, row->size);
+  if (cols <= 0 || width == 0) return 1;
+  return (width + cols - 1) / cols;
+}
+
+void editorWrapRowChanged(erow *row) {
+  if (!E.wrapcols || row->idx >= E.wrapidx.len) return;
+  int old = rowIndexGet(&E.wrapidx, row->idx);
+  rowIndexAdd(&E.wrapidx, row->idx, editorRowWraps(row, E.wrapcols) - old);
+}
+
+void editorWrapInvalidate() {
+  rowIndexClear(&E.wrapidx);
+  E.wrapcols = 0;
+}
+
+struct wrapChunk {
+  int from;
+  int to;
+};
+
+/* Fills whole blocks [from, to) of E.wrapidx. */
+void *editorWrapFill(void *arg) {
+  struct wrapChunk *chunk = arg;
+  for (int b = chunk->from; b < chunk->to; b++) {
+    struct rowBlock *blk = E.wrapidx.blocks[b];
+    int base = b * ROWINDEX_BLOCK;
+    blk->sum = 0;
+    for (int i = 0; i < blk->n; i++) {
+      blk->vals[i] = editorRowWraps(&E.row[base + i], E.wrapcols);
+      blk->sum += blk->vals[i];
+    }
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
+  return NULL;
 }
 
-void editorInsertNewline() {
+void editorWrapSync() {
+  if (E.wrapcols == E.screencols) return;
+  E.wrapcols = E.screencols;
+  rowIndexReset(&E.wrapidx, E.numrows);
+
+  int nblocks = E.wrapidx.nblocks;
+  int perthread = KILO_WRAP_CHUNK / ROWINDEX_BLOCK;
+  int nthreads = nblocks / perthread + 1;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > ncpu) nthreads = ncpu > 0 ? ncpu : 1;
+
+  struct wrapChunk *chunks = malloc(sizeof(struct wrapChunk) * nthreads);
+  pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+  int per = (nblocks + nthreads - 1) / nthreads;
+  int i, started = 1;
+  for (i = 0; i < nthreads; i++) {
+    chunks[i].from = i * per;
+    chunks[i].to = chunks[i].from + per;
+    if (chunks[i].to > nblocks) chunks[i].to = nblocks;
+    if (chunks[i].from > nblocks) chunks[i].from = nblocks;
+  }
+  while (started < nthreads && pthread_create(&threads[started], NULL,
+                                              editorWrapFill,
+                                              &chunks[started]) == 0)
+    started++;
+  for (i = started; i < nthreads; i++) editorWrapFill(&chunks[i]);
+  editorWrapFill(&chunks[0]);
+  for (i = 1; i < started; i++) pthread_join(threads[i], NULL);
+  free(chunks);
+  free(threads);
+}
+
+long long editorWrapLine(int filerow) {
+  editorWrapSync();
+  return rowIndexPrefix(&E.wrapidx, filerow);
+}
+
+/* Maps a screen line to its file row and the wrapped segment within it. */
+int editorWrapRow(long long vrow, int *sub) {
+  editorWrapSync();
+  int filerow = rowIndexSearch(&E.wrapidx, vrow);
+  *sub = vrow - rowIndexPrefix(&E.wrapidx, filerow);
+  return filerow;
+}
+
+void editorToggleWrap() {
+  E.softwrap = !E.softwrap;
+  if (!E.softwrap) editorWrapInvalidate();
+  E.vrowoff = -1;
+  E.coloff = 0;
+  E.fullredraw = 1;
+  editorSetStatusMessage("Soft wrap %s", E.softwrap ? "on" : "off");
+}
+
+void editorWrapPage(int key) {
+  long long total = editorWrapLine(E.numrows);
+  long long target = E.vrowoff + (key == PAGE_UP ? -E.screenrows
+                                                 : E.screenrows);
+  if (target > total - 1) target = total - 1;
+  if (target < 0) target = 0;
+  E.vrowoff = target;
+
+  int sub;
+  E.cy = editorWrapRow(target, &sub);
+  E.cx = 0;
+  if (E.cy < E.numrows)
+    E.cx = editorRowRxToCx(&E.row[E.cy], sub * E.screencols);
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c) {
+  if (E.cy == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+  }
+  editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  E.cx++;
+}
+
+void editorInsertNewline() {
   if (E.cx == 0) {
     editorInsertRow(E.cy, "", 0);
   } else {
     erow *row = &E.row[E.cy];
     editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
     row = &E.row[E.cy];
+    editorIndexRowResized(row, E.cx - row->size);
     row->size = E.cx;
     row->chars[row->size] = '\0';
+    row->dirty = 1;
     editorUpdateRow(row);
   }
   E.cy++;
@@ -552,8 +1637,301 @@ void editorDelChar() {
   }
 }
 
+/*** append buffer ***/
+
+struct abuf {
+  char *b;
+  int len;
+};
+
+#define ABUF_INIT {NULL, 0}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+  char *new = realloc(ab->b, ab->len + len);
+
+  if (new == NULL) return;
+  memcpy(&new[ab->len], s, len);
+  ab->b = new;
+  ab->len += len;
+}
+
+void abFree(struct abuf *ab) {
+  free(ab->b);
+}
+
+/*** line cache ***/
+
+/* For large files, the row start offsets and each row's hl_open_comment are
+ * kept in a sidecar file under the cache directory, keyed by the file's
+ * path and validated against its size, mtime, a sampled content hash and
+ * the syntax in use. Reopening an unchanged file then splits it by those
+ * offsets and highlights rows lazily as they are drawn. */
+
+struct lineCacheHeader {
+  char magic[8];
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t hash;
+  uint32_t syntax;
+  uint32_t nrows;
+};
+
+uint64_t lineCacheHashBytes(uint64_t h, const unsigned char *p, size_t len) {
+  for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 1099511628211ull;
+  return h;
+}
+
+uint64_t lineCacheSampleHash(int fd, long long size) {
+  unsigned char buf[4096];
+  uint64_t h = 14695981039346656037ull;
+  long long step = size / LINECACHE_SAMPLES;
+  if (step < (long long)sizeof(buf)) step = sizeof(buf);
+
+  for (long long off = 0; off < size; off += step) {
+    ssize_t n = pread(fd, buf, sizeof(buf), off);
+    if (n <= 0) break;
+    h = lineCacheHashBytes(h, buf, n);
+  }
+  if (size > (long long)sizeof(buf)) {
+    ssize_t n = pread(fd, buf, sizeof(buf), size - sizeof(buf));
+    if (n > 0) h = lineCacheHashBytes(h, buf, n);
+  }
+  return h;
+}
+
+uint32_t lineCacheSyntaxId() {
+  if (E.syntax == NULL) return 0;
+  struct abuf ab = ABUF_INIT;
+  char flags[16];
+  char *parts[4] = {
+    E.syntax->filetype, E.syntax->singleline_comment_start,
+    E.syntax->multiline_comment_start, E.syntax->multiline_comment_end
+  };
+  for (int i = 0; i < 4; i++) {
+    if (parts[i]) abAppend(&ab, parts[i], strlen(parts[i]));
+    abAppend(&ab, "", 1);
+  }
+  snprintf(flags, sizeof(flags), "%d", E.syntax->flags);
+  abAppend(&ab, flags, strlen(flags));
+  uint32_t id = syntaxHash(ab.b, ab.len) | 1;
+  abFree(&ab);
+  return id;
+}
+
+/* Fills `path` with the sidecar location for `filename`, or returns -1 if
+ * caching is disabled or the file is too small to bother. */
+int lineCachePath(const char *filename, long long size, char *path,
+                  size_t pathsize) {
+  if (getenv("KILO_NOCACHE") || size < LINECACHE_MIN_SIZE) return -1;
+
+  char dir[4096];
+  const char *env = getenv("KILO_CACHE_DIR");
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (env) snprintf(dir, sizeof(dir), "%s", env);
+  else if (xdg) snprintf(dir, sizeof(dir), "%s/kilo", xdg);
+  else if (home) snprintf(dir, sizeof(dir), "%s/.cache/kilo", home);
+  else return -1;
+
+  char *real = realpath(filename, NULL);
+  if (real == NULL) return -1;
+  uint64_t h = lineCacheHashBytes(14695981039346656037ull,
+                                  (const unsigned char *)real, strlen(real));
+  free(real);
+
+  snprintf(path, pathsize, "%s/%016llx.idx", dir, (unsigned long long)h);
+  return 0;
+}
+
+void lineCacheFillHeader(struct lineCacheHeader *hdr, int fd) {
+  struct stat st;
+  memset(hdr, 0, sizeof(*hdr));
+  memcpy(hdr->magic, LINECACHE_MAGIC, 8);
+  if (fstat(fd, &st) == -1) return;
+  hdr->size = st.st_size;
+  hdr->mtime_sec = st.st_mtim.tv_sec;
+  hdr->mtime_nsec = st.st_mtim.tv_nsec;
+  hdr->hash = lineCacheSampleHash(fd, st.st_size);
+  hdr->syntax = lineCacheSyntaxId();
+}
+
+/* The header only says the file is unchanged; the offsets table itself is
+ * checked before any row is cut out of the file with it. Offsets must start
+ * at 0, never decrease, end at the file size, and give rows that fit an
+ * int. */
+int lineCacheValid(const uint64_t *offsets, uint32_t nrows, long long size) {
+  if (nrows > INT_MAX - 1 || offsets[0] != 0 ||
+      offsets[nrows] != (uint64_t)size)
+    return 0;
+  for (uint32_t j = 0; j < nrows; j++) {
+    if (offsets[j + 1] < offsets[j] || offsets[j + 1] - offsets[j] > INT_MAX)
+      return 0;
+  }
+  return 1;
+}
+
+/* Loads the open file's rows using its sidecar. Returns 0 on success, or -1
+ * if there is no valid cache and the file has to be scanned. */
+int editorOpenCached(const char *filename) {
+  char path[4200];
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return -1;
+  if (fstat(fd, &st) == -1 ||
+      lineCachePath(filename, st.st_size, path, sizeof(path)) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  int cfd = open(path, O_RDONLY);
+  struct stat cst;
+  if (cfd == -1 || fstat(cfd, &cst) == -1 ||
+      cst.st_size < (off_t)sizeof(struct lineCacheHeader)) {
+    if (cfd != -1) close(cfd);
+    close(fd);
+    return -1;
+  }
+  char *cache = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, cfd, 0);
+  close(cfd);
+  if (cache == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  struct lineCacheHeader hdr, *chdr = (struct lineCacheHeader *)cache;
+  lineCacheFillHeader(&hdr, fd);
+  size_t expect = sizeof(hdr) + (chdr->nrows + 1ull) * sizeof(uint64_t) +
+                  chdr->nrows;
+  const uint64_t *offsets = (const uint64_t *)&cache[sizeof(hdr)];
+  char *data = MAP_FAILED;
+  if (memcmp(chdr, &hdr, offsetof(struct lineCacheHeader, nrows)) ||
+      (size_t)cst.st_size != expect || st.st_size == 0 ||
+      !lineCacheValid(offsets, chdr->nrows, st.st_size) ||
+      (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+        MAP_FAILED) {
+    munmap(cache, cst.st_size);
+    close(fd);
+    return -1;
+  }
+
+  const unsigned char *open_comment =
+    (const unsigned char *)&offsets[chdr->nrows + 1];
+  int nrows = chdr->nrows;
+
+  editorRowsReserve(E.numrows + nrows);
+  for (int j = 0; j < nrows; j++) {
+    erow *row = &E.row[E.numrows];
+    const char *line = &data[offsets[j]];
+    long long rawlen = offsets[j + 1] - offsets[j];
+    long long len = rawlen;
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      len--;
+
+    row->idx = E.numrows;
+    row->size = len;
+    row->chars = malloc(len + 1);
+    memcpy(row->chars, line, len);
+    row->chars[len] = '\0';
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->hl_open_comment = open_comment[j];
+    row->dirty = 0;
+    row->orig_off = -1;
+    row->matches = NULL;
+    row->nmatches = 0;
+    row->match_gen = 0;
+    row->packed = 0;
+    if (rawlen == len + 1 && line[len] == '\n') row->orig_off = offsets[j];
+    rowIndexInsert(&E.lineidx, E.numrows, len + 1);
+    E.numrows++;
+  }
+
+  munmap(data, st.st_size);
+  munmap(cache, cst.st_size);
+  /* rows were appended without the row operations, so a wrap index left
+   * over from a reused scratch buffer no longer matches */
+  editorWrapInvalidate();
+  editorFileStat(fd);
+  close(fd);
+  E.fullredraw = 1;
+  return 0;
+}
+
+void editorWriteLineCache(const char *filename, const uint64_t *offsets) {
+  char path[4200], tmp[4300];
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return;
+
+  struct lineCacheHeader hdr;
+  lineCacheFillHeader(&hdr, fd);
+  close(fd);
+  if (lineCachePath(filename, hdr.size, path, sizeof(path)) == -1) return;
+  hdr.nrows = E.numrows;
+
+  char *slash = strrchr(path, '/');
+  *slash = '\0';
+  if (mkdir(path, 0700) == -1 && errno == ENOENT) {
+    char *parent = strrchr(path, '/');
+    if (parent) {
+      *parent = '\0';
+      mkdir(path, 0700);
+      *parent = '/';
+      mkdir(path, 0700);
+    }
+  }
+  *slash = '/';
+
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  FILE *fp = fopen(tmp, "wb");
+  if (fp == NULL) return;
+
+  int ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+           fwrite(offsets, sizeof(uint64_t), E.numrows + 1, fp) ==
+             (size_t)E.numrows + 1;
+  for (int j = 0; ok && j < E.numrows; j++)
+    ok = fputc(E.row[j].hl_open_comment != 0, fp) != EOF;
+  if (fclose(fp) != 0) ok = 0;
+  if (!ok || rename(tmp, path) == -1) unlink(tmp);
+}
+
 /*** file i/o ***/
 
+void editorFreeResults(struct grepResults *res) {
+  for (int j = 0; j < res->nhits; j++) {
+    free(res->hits[j].path);
+    free(res->hits[j].text);
+  }
+  free(res->hits);
+  free(res->query);
+  free(res);
+}
+
+void editorFreeBuffer() {
+  for (int j = 0; j < E.numrows; j++) editorFreeRow(&E.row[j]);
+  free(E.row);
+  free(E.arena);
+  E.row = NULL;
+  E.arena = NULL;
+  E.numrows = 0;
+  E.rowcap = 0;
+  rowIndexClear(&E.lineidx);
+  editorWrapInvalidate();
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  if (E.results) editorFreeResults(E.results);
+  E.results = NULL;
+  if (E.hex.fd != -1) close(E.hex.fd);
+  E.hex.fd = -1;
+  E.cx = E.cy = E.rx = 0;
+  E.rowoff = E.coloff = 0;
+  E.dirty = 0;
+  E.file_size = -1;
+  E.fullredraw = 1;
+}
+
 char *editorRowsToString(int *buflen) {
   int totlen = 0;
   int j;
@@ -573,27 +1951,151 @@ char *editorRowsToString(int *buflen) {
   return buf;
 }
 
+void editorFileStat(int fd) {
+  struct stat st;
+  E.file_size = -1;
+  if (fstat(fd, &st) == 0) {
+    E.file_size = st.st_size;
+    E.file_mtime = st.st_mtim;
+  }
+}
+
+void editorMarkSaved(int fd) {
+  long long offset = 0;
+  for (int j = 0; j < E.numrows; j++) {
+    E.row[j].dirty = 0;
+    E.row[j].orig_off = offset;
+    offset += E.row[j].size + 1;
+  }
+  editorFileStat(fd);
+}
+
 void editorOpen(char *filename) {
   free(E.filename);
   E.filename = strdup(filename);
 
+  if (E.hex_force || editorHexProbe(filename)) {
+    editorHexOpen();
+    return;
+  }
+
   editorSelectSyntaxHighlight();
 
+  if (editorOpenCached(filename) == 0) return;
+
   FILE *fp = fopen(filename, "r");
   if (!fp) die("fopen");
 
   char *line = NULL;
   size_t linecap = 0;
   ssize_t linelen;
+  long long offset = 0;
+  uint64_t *offsets = NULL;
+  int offsetcap = 0;
   while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    if (E.numrows + 1 >= offsetcap) {
+      offsetcap = offsetcap ? offsetcap * 2 : 1024;
+      offsets = realloc(offsets, sizeof(uint64_t) * offsetcap);
+    }
+    offsets[E.numrows] = offset;
+
+    ssize_t rawlen = linelen;
     while (linelen > 0 && (line[linelen - 1] == '\n' ||
                            line[linelen - 1] == '\r'))
       linelen--;
     editorInsertRow(E.numrows, line, linelen);
+
+    /* only rows stored on disk exactly as chars + '\n' can be left in
+     * place by a partial save */
+    erow *row = &E.row[E.numrows - 1];
+    row->dirty = 0;
+    if (rawlen == linelen + 1 && line[linelen] == '\n')
+      row->orig_off = offset;
+    offset += rawlen;
   }
   free(line);
+  editorFileStat(fileno(fp));
   fclose(fp);
   E.dirty = 0;
+
+  if (offsets) {
+    offsets[E.numrows] = offset;
+    editorWriteLineCache(filename, offsets);
+    free(offsets);
+  }
+}
+
+/* Writes only what changed since the file was opened or last saved. If the
+ * size is unchanged, each run of rows that are dirty or have moved is
+ * pwrite()n in place; otherwise everything from the first such row onward
+ * is rewritten and the file truncated. Returns the number of bytes written,
+ * or -1 if the caller must fall back to a full rewrite. */
+long long editorSaveInPlace() {
+  struct stat st;
+  if (E.file_size < 0 || stat(E.filename, &st) == -1 ||
+      st.st_size != E.file_size ||
+      st.st_mtim.tv_sec != E.file_mtime.tv_sec ||
+      st.st_mtim.tv_nsec != E.file_mtime.tv_nsec)
+    return -1;
+
+  long long pos = 0, first_pos = 0;
+  int first = -1;
+  int j;
+  for (j = 0; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    if (first == -1 && (row->dirty || row->orig_off != pos)) {
+      first = j;
+      first_pos = pos;
+    }
+    pos += row->size + 1;
+  }
+  long long newlen = pos;
+  if (first == -1 && newlen == E.file_size) return 0;
+
+  int fd = open(E.filename, O_RDWR);
+  if (fd == -1) return -1;
+
+  long long written = 0;
+  struct abuf ab = ABUF_INIT;
+  if (first == -1) {
+    if (ftruncate(fd, newlen) == -1) goto fail;
+  } else if (newlen == E.file_size) {
+    pos = first_pos;
+    for (j = first; j < E.numrows; ) {
+      long long start = pos;
+      ab.len = 0;
+      while (j < E.numrows && (E.row[j].dirty || E.row[j].orig_off != pos)) {
+        abAppend(&ab, E.row[j].chars, E.row[j].size);
+        abAppend(&ab, "\n", 1);
+        pos += E.row[j].size + 1;
+        j++;
+      }
+      if (ab.len && pwrite(fd, ab.b, ab.len, start) != ab.len) goto fail;
+      written += ab.len;
+      while (j < E.numrows && !E.row[j].dirty && E.row[j].orig_off == pos) {
+        pos += E.row[j].size + 1;
+        j++;
+      }
+    }
+  } else {
+    for (j = first; j < E.numrows; j++) {
+      abAppend(&ab, E.row[j].chars, E.row[j].size);
+      abAppend(&ab, "\n", 1);
+    }
+    if (pwrite(fd, ab.b, ab.len, first_pos) != ab.len) goto fail;
+    if (ftruncate(fd, newlen) == -1) goto fail;
+    written = ab.len;
+  }
+
+  abFree(&ab);
+  editorMarkSaved(fd);
+  close(fd);
+  return written;
+
+fail:
+  abFree(&ab);
+  close(fd);
+  return -1;
 }
 
 void editorSave() {
@@ -606,6 +2108,13 @@ void editorSave() {
     editorSelectSyntaxHighlight();
   }
 
+  long long written = editorSaveInPlace();
+  if (written >= 0) {
+    E.dirty = 0;
+    editorSetStatusMessage("%lld bytes written to disk", written);
+    return;
+  }
+
   int len;
   char *buf = editorRowsToString(&len);
 
@@ -613,6 +2122,7 @@ void editorSave() {
   if (fd != -1) {
     if (ftruncate(fd, len) != -1) {
       if (write(fd, buf, len) == len) {
+        editorMarkSaved(fd);
         close(fd);
         free(buf);
         E.dirty = 0;
@@ -627,108 +2137,1933 @@ void editorSave() {
   editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
 }
 
-/*** find ***/
+/*** buffers ***/
+
+/* The active buffer lives in E; the others are parked in E.buffers. A
+ * parked buffer keeps only its rows' chars (render and hl are rebuilt
+ * lazily), and when the loaded buffers exceed E.mem_budget the least
+ * recently used clean ones are unloaded entirely and reopened from disk on
+ * the next switch. */
+
+void editorBufferStash(struct editorBuffer *b) {
+  b->cx = E.cx;
+  b->cy = E.cy;
+  b->rx = E.rx;
+  b->rowoff = E.rowoff;
+  b->coloff = E.coloff;
+  b->numrows = E.numrows;
+  b->rowcap = E.rowcap;
+  b->row = E.row;
+  b->arena = E.arena;
+  b->lineidx = E.lineidx;
+  b->dirty = E.dirty;
+  b->filename = E.filename;
+  b->file_size = E.file_size;
+  b->file_mtime = E.file_mtime;
+  b->syntax = E.syntax;
+  b->results = E.results;
+  b->hex = E.hex;
+}
 
-void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
+void editorBufferUnstash(struct editorBuffer *b) {
+  E.cx = b->cx;
+  E.cy = b->cy;
+  E.rx = b->rx;
+  E.rowoff = b->rowoff;
+  E.coloff = b->coloff;
+  E.numrows = b->numrows;
+  E.rowcap = b->rowcap;
+  E.row = b->row;
+  E.arena = b->arena;
+  E.lineidx = b->lineidx;
+  E.dirty = b->dirty;
+  E.filename = b->filename;
+  E.file_size = b->file_size;
+  E.file_mtime = b->file_mtime;
+  E.syntax = b->syntax;
+  E.results = b->results;
+  E.hex = b->hex;
+}
 
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
+long long editorRowsMemory(erow *rows, int numrows) {
+  long long total = sizeof(erow) * (long long)numrows;
+  for (int j = 0; j < numrows; j++) {
+    total += rows[j].size + 1;
+    if (rows[j].render) total += rows[j].rsize * 2 + 1;
+  }
+  return total;
+}
 
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
+/* Drops everything that can be rebuilt from chars. */
+void editorRowsDropDerived(erow *rows, int numrows) {
+  for (int j = 0; j < numrows; j++) {
+    free(rows[j].render);
+    free(rows[j].hl);
+    free(rows[j].matches);
+    rows[j].render = NULL;
+    rows[j].hl = NULL;
+    rows[j].rsize = 0;
+    rows[j].matches = NULL;
+    rows[j].nmatches = 0;
+    rows[j].match_gen = 0;
   }
+}
 
-  if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
+void editorBufferRelease(struct editorBuffer *b) {
+  for (int j = 0; j < b->numrows; j++) editorFreeRow(&b->row[j]);
+  free(b->row);
+  free(b->arena);
+  rowIndexFree(&b->lineidx);
+  b->row = NULL;
+  b->arena = NULL;
+  b->numrows = 0;
+  b->rowcap = 0;
+  b->loaded = 0;
+  b->mem = 0;
+}
+
+int editorBufferAdd(const char *filename) {
+  E.buffers = realloc(E.buffers, sizeof(struct editorBuffer) *
+                      (E.nbuffers + 1));
+  struct editorBuffer *b = &E.buffers[E.nbuffers];
+  memset(b, 0, sizeof(*b));
+  b->filename = filename ? strdup(filename) : NULL;
+  b->file_size = -1;
+  b->hex.fd = -1;
+  b->loaded = filename == NULL;
+  return E.nbuffers++;
+}
+
+void editorBufferEvict() {
+  long long total = editorRowsMemory(E.row, E.numrows);
+  int j;
+  for (j = 0; j < E.nbuffers; j++) {
+    if (j != E.curbuf && E.buffers[j].loaded) total += E.buffers[j].mem;
+  }
+
+  while (total > E.mem_budget) {
+    int victim = -1;
+    for (j = 0; j < E.nbuffers; j++) {
+      struct editorBuffer *b = &E.buffers[j];
+      if (j == E.curbuf || !b->loaded || b->dirty || b->filename == NULL ||
+          b->results || b->numrows == 0)
+        continue;
+      if (victim == -1 || b->last_used < E.buffers[victim].last_used)
+        victim = j;
+    }
+    if (victim == -1) break;
+    total -= E.buffers[victim].mem;
+    editorBufferRelease(&E.buffers[victim]);
+  }
+}
+
+void editorBufferSwitch(int to) {
+  if (to == E.curbuf) return;
+
+  struct editorBuffer *cur = &E.buffers[E.curbuf];
+  editorBufferStash(cur);
+  editorRowsDropDerived(cur->row, cur->numrows);
+  cur->mem = editorRowsMemory(cur->row, cur->numrows);
+
+  struct editorBuffer *b = &E.buffers[to];
+  E.curbuf = to;
+  b->last_used = ++E.buffer_clock;
+  editorBufferUnstash(b);
+  editorWrapInvalidate();
+  E.vrowoff = -1;
+
+  if (!b->loaded) {
+    int cx = E.cx, cy = E.cy;
+    if (E.filename && access(E.filename, R_OK) == 0) {
+      char *filename = strdup(E.filename);
+      E.hex_force = b->hex_force;
+      editorOpen(filename);
+      E.hex_force = 0;
+      free(filename);
+    }
+    b->loaded = 1;
+    E.cy = cy < E.numrows ? cy : E.numrows;
+    E.cx = E.cy < E.numrows && cx <= E.row[E.cy].size ? cx : 0;
+  }
+
+  E.fullredraw = 1;
+  editorBufferEvict();
+}
+
+/* Makes the active buffer an empty one to load something new into, reusing
+ * it if it is an untouched scratch buffer. */
+void editorBufferFresh() {
+  if (E.filename == NULL && E.numrows == 0 && !E.dirty && !E.results &&
+      E.hex.fd == -1)
     return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
+  editorBufferSwitch(editorBufferAdd(NULL));
+}
+
+int editorBufferOpen(const char *filename) {
+  for (int j = 0; j < E.nbuffers; j++) {
+    const char *name = j == E.curbuf ? E.filename : E.buffers[j].filename;
+    if (name && !strcmp(name, filename)) {
+      editorBufferSwitch(j);
+      return 0;
+    }
+  }
+
+  if (access(filename, R_OK) == -1 && errno != ENOENT) {
+    editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+    return -1;
+  }
+
+  editorBufferFresh();
+  if (access(filename, R_OK) == 0) {
+    editorOpen((char *)filename);
   } else {
-    last_match = -1;
-    direction = 1;
+    E.filename = strdup(filename);
+    editorSelectSyntaxHighlight();
   }
+  E.buffers[E.curbuf].loaded = 1;
+  editorBufferEvict();
+  return 0;
+}
 
-  if (last_match == -1) direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1) current = E.numrows - 1;
-    else if (current == E.numrows) current = 0;
+void editorBufferNext() {
+  if (E.nbuffers < 2) {
+    editorSetStatusMessage("No other buffers (Ctrl-O to open a file)");
+    return;
+  }
+  editorBufferSwitch((E.curbuf + 1) % E.nbuffers);
+  editorSetStatusMessage("Buffer %d/%d: %s", E.curbuf + 1, E.nbuffers,
+    E.results ? "*grep*" : E.filename ? E.filename : "[No Name]");
+}
+
+void editorBufferPrompt() {
+  char *filename = editorPrompt("Open: %s (ESC to cancel)", NULL);
+  if (filename == NULL) return;
+  editorBufferOpen(filename);
+  free(filename);
+}
+
+int editorBuffersDirty() {
+  if (E.dirty) return 1;
+  for (int j = 0; j < E.nbuffers; j++) {
+    if (j != E.curbuf && E.buffers[j].dirty) return 1;
+  }
+  return 0;
+}
+
+/*** memory ***/
+
+struct editorMemStats {
+  long long rows;
+  long long chars;
+  long long render;
+  long long hl;
+  long long match;
+  long long index;
+  long long slack;
+};
+
+/* Adds an allocation's requested size to *used and the allocator's extra
+ * padding to the slack total. */
+void editorMemCount(struct editorMemStats *st, long long *used, void *p,
+                    long long size) {
+  if (p == NULL) return;
+  *used += size;
+  long long usable = malloc_usable_size(p);
+  if (usable > size) st->slack += usable - size;
+}
+
+void editorMemRowIndex(struct editorMemStats *st, struct rowIndex *ix) {
+  for (int j = 0; j < ix->nblocks; j++)
+    editorMemCount(st, &st->index, ix->blocks[j], sizeof(struct rowBlock));
+  editorMemCount(st, &st->index, ix->blocks,
+                 sizeof(struct rowBlock *) * (long long)ix->nblocks);
+  editorMemCount(st, &st->index, ix->counts.tree,
+                 sizeof(long long) * (ix->counts.len + 1LL));
+  editorMemCount(st, &st->index, ix->sums.tree,
+                 sizeof(long long) * (ix->sums.len + 1LL));
+}
+
+void editorMemStats(struct editorMemStats *st) {
+  memset(st, 0, sizeof(*st));
+  editorMemCount(st, &st->rows, E.row, sizeof(erow) * (long long)E.numrows);
+  long long packed = 0;
+  for (int j = 0; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    if (row->packed) packed += row->size + 1;
+    else editorMemCount(st, &st->chars, row->chars, row->size + 1);
+    editorMemCount(st, &st->render, row->render, row->rsize + 1);
+    editorMemCount(st, &st->hl, row->hl, row->rsize);
+    editorMemCount(st, &st->match, row->matches,
+                   sizeof(int) * 2 * (long long)row->nmatches);
+  }
+  editorMemCount(st, &st->chars, E.arena, packed);
+  editorMemRowIndex(st, &E.lineidx);
+  editorMemRowIndex(st, &E.wrapidx);
+}
+
+long long editorMemTotal(struct editorMemStats *st) {
+  return st->rows + st->chars + st->render + st->hl + st->match +
+         st->index + st->slack;
+}
+
+char *editorFormatBytes(char *buf, long long n) {
+  if (n < 1024) sprintf(buf, "%lldB", n);
+  else if (n < 1024 * 1024) sprintf(buf, "%lldK", n / 1024);
+  else if (n < 1024LL * 1024 * 1024) sprintf(buf, "%.1fM", n / 1048576.0);
+  else sprintf(buf, "%.1fG", n / 1073741824.0);
+  return buf;
+}
+
+void editorMemReport() {
+  struct editorMemStats st;
+  editorMemStats(&st);
+  char b[8][16];
+  editorSetStatusMessage(
+    "Mem %s: rows %s chars %s render %s hl %s match %s idx %s slack %s",
+    editorFormatBytes(b[7], editorMemTotal(&st)),
+    editorFormatBytes(b[0], st.rows), editorFormatBytes(b[1], st.chars),
+    editorFormatBytes(b[2], st.render), editorFormatBytes(b[3], st.hl),
+    editorFormatBytes(b[4], st.match), editorFormatBytes(b[5], st.index),
+    editorFormatBytes(b[6], st.slack));
+}
+
+/* Copies every row's chars into one arena, frees render/hl/matches for the
+ * rows that are off screen, trims E.row to fit and hands free heap pages
+ * back to the OS. */
+void editorCompact() {
+  struct editorMemStats st;
+  editorMemStats(&st);
+  long long before = editorMemTotal(&st);
+
+  int top = E.rowoff < E.numrows ? E.rowoff : E.numrows;
+  int bottom = top + E.screenrows < E.numrows ? top + E.screenrows
+                                              : E.numrows;
+  editorRowsDropDerived(E.row, top);
+  editorRowsDropDerived(&E.row[bottom], E.numrows - bottom);
+
+  long long total = 0;
+  int j;
+  for (j = 0; j < E.numrows; j++) total += E.row[j].size + 1;
+  char *arena = total ? malloc(total) : NULL;
+  long long off = 0;
+  for (j = 0; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    memcpy(&arena[off], row->chars, row->size + 1);
+    if (!row->packed) free(row->chars);
+    row->chars = &arena[off];
+    row->packed = 1;
+    off += row->size + 1;
+  }
+  free(E.arena);
+  E.arena = arena;
+
+  if (E.numrows == 0) {
+    free(E.row);
+    E.row = NULL;
+  } else {
+    E.row = realloc(E.row, sizeof(erow) * E.numrows);
+  }
+  E.rowcap = E.numrows;
+  malloc_trim(0);
+
+  editorMemStats(&st);
+  char b[2][16];
+  editorSetStatusMessage("Compacted %s -> %s",
+                         editorFormatBytes(b[0], before),
+                         editorFormatBytes(b[1], editorMemTotal(&st)));
+  E.fullredraw = 1;
+}
+
+/*** goto ***/
+
+void editorGoto() {
+  char *query = editorPrompt("Go to line: %s (@N for byte offset, ESC to cancel)",
+                             NULL);
+  if (query == NULL) return;
+
+  if (query[0] == '@') {
+    long long offset = strtoll(&query[1], NULL, 10);
+    if (offset < 0) offset = 0;
+    int filerow = editorOffsetToRow(offset);
+    if (filerow >= E.numrows) {
+      E.cy = E.numrows;
+      E.cx = 0;
+    } else {
+      long long col = offset - editorRowOffset(filerow);
+      if (col > E.row[filerow].size) col = E.row[filerow].size;
+      E.cy = filerow;
+      E.cx = col;
+    }
+  } else {
+    int line = atoi(query);
+    if (line < 1) line = 1;
+    if (line > E.numrows) line = E.numrows;
+    E.cy = line > 0 ? line - 1 : 0;
+    E.cx = 0;
+  }
+
+  free(query);
+}
+
+/*** hex view ***/
+
+/* Binary files are shown 16 bytes per line as offset, hex and ASCII
+ * columns. Nothing is loaded up front: each frame preads just the visible
+ * lines and formats them through lookup tables, so memory use does not
+ * depend on the file size. The view is read-only. */
+
+static const char hexDigits[] = "0123456789abcdef";
+
+/* A file is treated as binary if its first HEX_PROBE_SIZE bytes hold a NUL. */
+int editorHexProbe(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return 0;
+  char buf[HEX_PROBE_SIZE];
+  ssize_t n = read(fd, buf, sizeof(buf));
+  close(fd);
+  return n > 0 && memchr(buf, '\0', n) != NULL;
+}
+
+void editorHexOpen() {
+  E.hex.fd = open(E.filename, O_RDONLY);
+  if (E.hex.fd == -1) die("open");
+  editorFileStat(E.hex.fd);
+  E.hex.top = 0;
+  E.hex.cur = 0;
+  E.syntax = NULL;
+  E.dirty = 0;
+  E.fullredraw = 1;
+}
+
+void editorHexScroll() {
+  long long line = E.hex.cur - E.hex.cur % 16;
+  if (line < E.hex.top) E.hex.top = line;
+  if (line >= E.hex.top + (long long)E.screenrows * 16)
+    E.hex.top = line - (long long)(E.screenrows - 1) * 16;
+}
+
+void editorHexDraw(struct abuf *ab) {
+  static char ascii[256];
+  if (ascii['A'] == 0) {
+    for (int i = 0; i < 256; i++) ascii[i] = (i >= 32 && i < 127) ? i : '.';
+  }
+
+  int digits = E.file_size > 0xffffffffLL ? 12 : 8;
+  int nbytes = E.screenrows * 16;
+  unsigned char *data = malloc(nbytes);
+  ssize_t n = pread(E.hex.fd, data, nbytes, E.hex.top);
+  if (n < 0) n = 0;
+
+  for (int y = 0; y < E.screenrows; y++) {
+    char line[128];
+    int len = 0;
+    int base = y * 16;
+    if (base < n || (n == 0 && y == 0)) {
+      long long off = E.hex.top + base;
+      for (int k = digits - 1; k >= 0; k--)
+        line[len++] = hexDigits[(off >> (4 * k)) & 0xf];
+      line[len++] = ' ';
+      for (int i = 0; i < 16; i++) {
+        if (i == 8) line[len++] = ' ';
+        line[len++] = ' ';
+        if (base + i < n) {
+          line[len++] = hexDigits[data[base + i] >> 4];
+          line[len++] = hexDigits[data[base + i] & 0xf];
+        } else {
+          line[len++] = ' ';
+          line[len++] = ' ';
+        }
+      }
+      line[len++] = ' ';
+      line[len++] = ' ';
+      line[len++] = '|';
+      for (int i = 0; i < 16 && base + i < n; i++)
+        line[len++] = ascii[data[base + i]];
+      line[len++] = '|';
+    } else {
+      line[len++] = '~';
+    }
+
+    if (len > E.screencols) len = E.screencols;
+    abAppend(ab, line, len);
+    abAppend(ab, "\x1b[K", 3);
+    abAppend(ab, "\r\n", 2);
+  }
+  free(data);
+}
+
+void editorHexDrawCursor(struct abuf *ab) {
+  int digits = E.file_size > 0xffffffffLL ? 12 : 8;
+  int col = E.hex.cur % 16;
+  char buf[32];
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+           (int)((E.hex.cur - E.hex.top) / 16) + 1,
+           digits + 2 + col * 3 + (col >= 8) + 1);
+  abAppend(ab, buf, strlen(buf));
+}
+
+/* Returns the offset of the first match starting in [start, end), or -1.
+ * Chunks overlap by plen - 1 bytes so matches across a boundary are found. */
+long long editorHexScan(const unsigned char *pat, int plen, long long start,
+                        long long end) {
+  unsigned char *buf = malloc(HEX_SEARCH_CHUNK + plen);
+  long long found = -1;
+  for (long long pos = start; pos < end && found == -1;
+       pos += HEX_SEARCH_CHUNK) {
+    long long want = HEX_SEARCH_CHUNK + plen - 1;
+    if (want > end - pos + plen - 1) want = end - pos + plen - 1;
+    ssize_t n = pread(E.hex.fd, buf, want, pos);
+    if (n < plen) break;
+    unsigned char *m = memmem(buf, n, pat, plen);
+    if (m && pos + (m - buf) < end) found = pos + (m - buf);
+  }
+  free(buf);
+  return found;
+}
+
+/* Parses "de ad be ef" style input into bytes; anything else is taken as
+ * literal text. */
+int editorHexParsePattern(const char *query, unsigned char *out) {
+  int len = 0, nibbles = 0;
+  const char *p;
+  for (p = query; *p; p++) {
+    if (isspace((unsigned char)*p)) continue;
+    const char *d = strchr(hexDigits, tolower((unsigned char)*p));
+    if (d == NULL) break;
+    if (nibbles++ % 2 == 0) out[len] = (d - hexDigits) << 4;
+    else out[len++] |= d - hexDigits;
+  }
+  if (*p == '\0' && nibbles > 0 && nibbles % 2 == 0) return len;
+
+  len = strlen(query);
+  memcpy(out, query, len);
+  return len;
+}
+
+void editorHexFind() {
+  char *query = editorPrompt("Find bytes: %s (hex like 'de ad', or text)",
+                             NULL);
+  if (query == NULL) return;
+
+  unsigned char *pat = malloc(strlen(query) + 1);
+  int plen = editorHexParsePattern(query, pat);
+  long long at = editorHexScan(pat, plen, E.hex.cur + 1, E.file_size);
+  if (at == -1) at = editorHexScan(pat, plen, 0, E.hex.cur + 1);
+  if (at == -1) {
+    editorSetStatusMessage("Pattern not found: %s", query);
+  } else {
+    E.hex.cur = at;
+    editorSetStatusMessage("Found at offset 0x%llx", at);
+  }
+  free(pat);
+  free(query);
+}
+
+void editorHexGoto() {
+  char *query = editorPrompt("Go to offset: %s (0x for hex, ESC to cancel)",
+                             NULL);
+  if (query == NULL) return;
+  E.hex.cur = strtoll(query, NULL, 0);
+  free(query);
+}
+
+/* Handles a key in hex view. Everything except quitting, opening or
+ * switching buffers and grep is consumed here, so no key can edit. */
+int editorHexKey(int c) {
+  long long page = (long long)E.screenrows * 16;
+  switch (c) {
+    case ARROW_LEFT: E.hex.cur--; break;
+    case ARROW_RIGHT: E.hex.cur++; break;
+    case ARROW_UP: E.hex.cur -= 16; break;
+    case ARROW_DOWN: E.hex.cur += 16; break;
+    case HOME_KEY: E.hex.cur -= E.hex.cur % 16; break;
+    case END_KEY: E.hex.cur += 15 - E.hex.cur % 16; break;
+    case PAGE_UP:
+    case PAGE_DOWN:
+      E.hex.cur += c == PAGE_UP ? -page : page;
+      E.hex.top += c == PAGE_UP ? -page : page;
+      if (E.hex.top < 0) E.hex.top = 0;
+      break;
+    case CTRL_KEY('f'): editorHexFind(); break;
+    case CTRL_KEY('g'): editorHexGoto(); break;
+    case CTRL_KEY('q'):
+    case CTRL_KEY('o'):
+    case CTRL_KEY('b'):
+    case CTRL_KEY('t'):
+      return 0;
+    default:
+      editorSetStatusMessage("Hex view is read-only");
+      return 1;
+  }
+
+  if (E.hex.cur > E.file_size - 1) E.hex.cur = E.file_size - 1;
+  if (E.hex.cur < 0) E.hex.cur = 0;
+  return 1;
+}
+
+/*** macros ***/
+
+/* Ctrl-R records the keys typed until the next Ctrl-R; Ctrl-P plays them
+ * back through a key queue that editorReadKey drains before the terminal.
+ * Playback runs as one batch: no frames are drawn and editorUpdateSyntax
+ * only records the range of touched rows, which is highlighted in a single
+ * pass at the end. */
+
+void editorMacroRowsShifted(int at, int delta) {
+  struct editorMacro *m = &E.macro;
+  if (!m->batch || m->lo == -1) return;
+  if (at <= m->hi) m->hi += delta;
+  if (at < m->lo) m->lo = m->lo + delta < at ? at : m->lo + delta;
+}
+
+void editorMacroToggle() {
+  struct editorMacro *m = &E.macro;
+  if (m->recording) {
+    m->recording = 0;
+    editorSetStatusMessage("Recorded macro of %d keys (Ctrl-P to apply)",
+                           m->nkeys);
+  } else {
+    m->recording = 1;
+    m->nkeys = 0;
+    editorSetStatusMessage("Recording macro... (Ctrl-R to stop)");
+  }
+}
+
+void editorMacroRun() {
+  struct editorMacro *m = &E.macro;
+  m->queue = m->keys;
+  m->qlen = m->nkeys;
+  m->qpos = 0;
+  while (m->qpos < m->qlen) editorProcessKeypress();
+  m->qlen = m->qpos = 0;
+}
+
+/* Highlights the rows touched by the batch in order, then lets the last one
+ * cascade a changed comment state past the range as usual. */
+void editorMacroFlush() {
+  struct editorMacro *m = &E.macro;
+  int lo = m->lo, hi = m->hi;
+  if (hi > E.numrows - 1) hi = E.numrows - 1;
+
+  m->batch = 2;
+  for (int j = lo; j >= 0 && j < hi; j++) {
+    if (E.row[j].render) editorUpdateSyntax(&E.row[j]);
+  }
+  m->batch = 0;
+  if (lo >= 0 && hi >= lo && E.row[hi].render) editorUpdateSyntax(&E.row[hi]);
+  E.fullredraw = 1;
+}
+
+void editorMacroApply() {
+  struct editorMacro *m = &E.macro;
+  if (m->recording) editorMacroToggle();
+  if (m->nkeys == 0) {
+    editorSetStatusMessage("No macro recorded (Ctrl-R to record)");
+    return;
+  }
+
+  char *query = editorPrompt("Apply macro: %s (N times, or FROM-TO lines)",
+                             NULL);
+  if (query == NULL) return;
+  int from, to, times = 0;
+  if (sscanf(query, "%d-%d", &from, &to) == 2) {
+    if (from < 1) from = 1;
+    if (to > E.numrows) to = E.numrows;
+  } else {
+    times = atoi(query);
+    from = 1;
+    to = 0;
+  }
+  free(query);
+
+  long long start = editorNow();
+  m->batch = 1;
+  m->lo = m->hi = -1;
+  int runs = 0;
+  if (times > 0) {
+    for (; runs < times; runs++) editorMacroRun();
+  } else {
+    for (int line = from; line <= to && line <= E.numrows; line++, runs++) {
+      E.cy = line - 1;
+      E.cx = 0;
+      editorMacroRun();
+    }
+  }
+  editorMacroFlush();
+
+  editorSetStatusMessage("Applied macro %d times in %.2fs", runs,
+                         (editorNow() - start) / 1e6);
+}
+
+/*** filter ***/
+
+/* Pipes a range of rows through a shell command. Rows are streamed to the
+ * child straight from their chars with writev() while its output is read
+ * back into new rows. The source rows' render and hl arrays are dropped up
+ * front, and the new rows are left unrendered until drawn, so peak memory
+ * stays close to the chars of the old and new ranges. Both sets of chars
+ * coexist until the child exits and the rows are swapped in. */
+
+int editorFilterParseLine(char **p, int *line) {
+  if (**p == '.') {
+    *line = E.cy + 1;
+    (*p)++;
+  } else if (**p == '$') {
+    *line = E.numrows;
+    (*p)++;
+  } else if (isdigit((unsigned char)**p)) {
+    *line = strtol(*p, p, 10);
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+/* Parses "RANGE CMD", where RANGE is %, N or N,M and N/M may be '.' or '$'.
+ * Returns the command, or NULL if the input is malformed. */
+char *editorFilterParse(char *input, int *first, int *last) {
+  char *p = input;
+  if (*p == '%') {
+    *first = 1;
+    *last = E.numrows;
+    p++;
+  } else {
+    if (editorFilterParseLine(&p, first) == -1) return NULL;
+    *last = *first;
+    if (*p == ',' && (p++, editorFilterParseLine(&p, last) == -1)) return NULL;
+  }
+  if (*p != ' ') return NULL;
+  while (*p == ' ') p++;
+  return *p ? p : NULL;
+}
+
+void editorFilterAddRow(erow **rows, int *nrows, int *cap, char *s, int len) {
+  if (len > 0 && s[len - 1] == '\r') len--;
+  if (*nrows == *cap) {
+    *cap = *cap ? *cap * 2 : 256;
+    *rows = realloc(*rows, sizeof(erow) * *cap);
+  }
+  erow *row = &(*rows)[(*nrows)++];
+  row->size = len;
+  row->chars = malloc(len + 1);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  row->rsize = 0;
+  row->render = NULL;
+  row->hl = NULL;
+  row->hl_open_comment = 0;
+  row->dirty = 1;
+  row->orig_off = -1;
+  row->matches = NULL;
+  row->nmatches = 0;
+  row->match_gen = 0;
+  row->packed = 0;
+}
+
+/* Replaces rows [at, at + nold) with `rows` and re-highlights only them,
+ * plus the following row if the comment state leaving the range changed. */
+void editorReplaceRows(int at, int nold, erow *rows, int nnew) {
+  int j;
+  int old_state = at + nold > 0 ? E.row[at + nold - 1].hl_open_comment : 0;
+  for (j = at; j < at + nold; j++) editorFreeRow(&E.row[j]);
+
+  editorRowsReserve(E.numrows - nold + nnew);
+  memmove(&E.row[at + nnew], &E.row[at + nold],
+          sizeof(erow) * (E.numrows - at - nold));
+  memcpy(&E.row[at], rows, sizeof(erow) * nnew);
+  E.numrows += nnew - nold;
+  for (j = at; j < E.numrows; j++) E.row[j].idx = j;
+  for (j = 0; j < nold; j++) {
+    rowIndexDelete(&E.lineidx, at);
+    if (E.wrapcols) rowIndexDelete(&E.wrapidx, at);
+  }
+  for (j = 0; j < nnew; j++) {
+    rowIndexInsert(&E.lineidx, at + j, E.row[at + j].size + 1);
+    if (E.wrapcols)
+      rowIndexInsert(&E.wrapidx, at + j,
+                     editorRowWraps(&E.row[at + j], E.wrapcols));
+  }
+  editorMacroRowsShifted(at, nnew - nold);
+
+  /* highlight the new rows in order only to carry hl_open_comment forward,
+   * without cascading (batch 2), then drop render and hl again so
+   * editorRowRender rebuilds them for the rows actually drawn */
+  if (E.syntax && E.syntax->multiline_comment_start) {
+    int batch = E.macro.batch;
+    E.macro.batch = 2;
+    for (j = at; j < at + nnew; j++) {
+      editorUpdateRow(&E.row[j]);
+      editorRowsDropDerived(&E.row[j], 1);
+    }
+    E.macro.batch = batch;
+  }
+  int new_state = at + nnew > 0 ? E.row[at + nnew - 1].hl_open_comment : 0;
+  if (new_state != old_state && at + nnew < E.numrows)
+    editorRowHighlight(&E.row[at + nnew]);
+
+  E.dirty++;
+  E.fullredraw = 1;
+}
+
+void editorFilter() {
+  char *input = editorPrompt("Filter: %s (RANGE CMD, e.g. %% sort or 10,20 jq .)",
+                             NULL);
+  if (input == NULL) return;
+
+  int first, last;
+  char *cmd = editorFilterParse(input, &first, &last);
+  if (cmd == NULL || first < 1 || last < first - 1 || last > E.numrows) {
+    editorSetStatusMessage("Bad filter: expected RANGE CMD");
+    free(input);
+    return;
+  }
+  int at = first - 1;
+  int nold = last - at;
+
+  int in[2], out[2];
+  if (pipe(in) == -1 || pipe(out) == -1) die("pipe");
+  pid_t pid = fork();
+  if (pid == -1) die("fork");
+  if (pid == 0) {
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull != -1) dup2(devnull, STDERR_FILENO);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    _exit(127);
+  }
+  close(in[0]);
+  close(out[1]);
+  fcntl(in[1], F_SETFL, O_NONBLOCK);
+  void (*oldpipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+  editorRowsDropDerived(&E.row[at], nold);
+
+  erow *rows = NULL;
+  int nrows = 0, cap = 0;
+  struct abuf pending = ABUF_INIT;
+  int idx = at;
+  int off = 0;
+  int infd = in[1];
+  if (nold == 0) {
+    close(infd);
+    infd = -1;
+  }
+
+  while (1) {
+    struct pollfd pfds[2] = {
+      { out[0], POLLIN, 0 },
+      { infd, POLLOUT, 0 }
+    };
+    if (poll(pfds, infd == -1 ? 1 : 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    if (infd != -1 && pfds[1].revents) {
+      static const char nl = '\n';
+      struct iovec iov[1024];
+      int n = 0;
+      for (int j = idx; j < at + nold && n + 2 <= 1024; j++) {
+        int skip = j == idx ? off : 0;
+        if (skip < E.row[j].size) {
+          iov[n].iov_base = &E.row[j].chars[skip];
+          iov[n].iov_len = E.row[j].size - skip;
+          n++;
+        }
+        iov[n].iov_base = (void *)&nl;
+        iov[n].iov_len = 1;
+        n++;
+      }
+      ssize_t w = writev(infd, iov, n);
+      if (w == -1 && errno != EAGAIN && errno != EINTR) w = -2;
+      while (w > 0) {
+        int left = E.row[idx].size + 1 - off;
+        if (w >= left) {
+          w -= left;
+          idx++;
+          off = 0;
+        } else {
+          off += w;
+          w = 0;
+        }
+      }
+      if (w == -2 || idx == at + nold) {
+        close(infd);
+        infd = -1;
+      }
+    }
+
+    if (pfds[0].revents) {
+      char buf[65536];
+      ssize_t n = read(out[0], buf, sizeof(buf));
+      if (n == -1 && errno == EINTR) continue;
+      if (n <= 0) break;
+      abAppend(&pending, buf, n);
+
+      char *start = pending.b, *end = pending.b + pending.len, *nl;
+      while ((nl = memchr(start, '\n', end - start)) != NULL) {
+        editorFilterAddRow(&rows, &nrows, &cap, start, nl - start);
+        start = nl + 1;
+      }
+      pending.len = end - start;
+      memmove(pending.b, start, pending.len);
+    }
+  }
+  if (pending.len) editorFilterAddRow(&rows, &nrows, &cap, pending.b,
+                                      pending.len);
+  abFree(&pending);
+  if (infd != -1) close(infd);
+  close(out[0]);
+  signal(SIGPIPE, oldpipe);
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+    editorReplaceRows(at, nold, rows, nrows);
+    if (E.cy > E.numrows) E.cy = E.numrows;
+    E.cx = 0;
+    editorSetStatusMessage("Filtered %d lines into %d", nold, nrows);
+  } else {
+    for (int j = 0; j < nrows; j++) editorFreeRow(&rows[j]);
+    editorSetStatusMessage("Filter failed (exit status %d)",
+                           WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+  }
+  free(rows);
+  free(input);
+}
+
+/*** find ***/
+
+char *editorFindMatch(const char *s, int len, const char *query, int qlen) {
+  if (qlen == 0) return NULL;
+  return memmem(s, len, query, qlen);
+}
+
+void editorFindCallback(char *query, int key) {
+  static int last_match = -1;
+  static int direction = 1;
+
+  static int saved_hl_line;
+  static char *saved_hl = NULL;
+
+  if (saved_hl) {
+    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
+    free(saved_hl);
+    saved_hl = NULL;
+    E.fullredraw = 1;
+  }
+
+  if (key == '\r' || key == '\x1b') {
+    last_match = -1;
+    direction = 1;
+    return;
+  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    direction = 1;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    direction = -1;
+  } else {
+    last_match = -1;
+    direction = 1;
+  }
+
+  if (last_match == -1) direction = 1;
+  int current = last_match;
+  int i;
+  for (i = 0; i < E.numrows; i++) {
+    current += direction;
+    if (current == -1) current = E.numrows - 1;
+    else if (current == E.numrows) current = 0;
+
+    erow *row = &E.row[current];
+    editorRowRender(row);
+    char *match = editorFindMatch(row->render, row->rsize, query,
+                                  strlen(query));
+    if (match) {
+      last_match = current;
+      E.cy = current;
+      E.cx = editorRowRxToCx(row, match - row->render);
+      E.rowoff = E.numrows;
+
+      saved_hl_line = current;
+      saved_hl = malloc(row->rsize);
+      memcpy(saved_hl, row->hl, row->rsize);
+      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+      E.fullredraw = 1;
+      break;
+    }
+  }
+}
+
+/* Highlight-all keeps, per row, the sorted [start, end) render intervals
+ * matching E.match_query. Rows are only scanned when drawn; an edit resets
+ * the row's generation so just that row is rescanned, and a new query bumps
+ * E.match_gen to invalidate every row at once. */
+
+void editorRowMatches(erow *row) {
+  if (row->match_gen == E.match_gen) return;
+  row->nmatches = 0;
+  row->match_gen = E.match_gen;
+  int qlen = strlen(E.match_query);
+  char *p = row->render;
+  char *end = row->render + row->rsize;
+  char *match;
+  int cap = 0;
+  while ((match = editorFindMatch(p, end - p, E.match_query, qlen))) {
+    if (row->nmatches == cap) {
+      cap = cap ? cap * 2 : 4;
+      row->matches = realloc(row->matches, sizeof(int) * 2 * cap);
+    }
+    row->matches[2 * row->nmatches] = match - row->render;
+    row->matches[2 * row->nmatches + 1] = match - row->render + qlen;
+    row->nmatches++;
+    p = match + qlen;
+  }
+}
+
+void editorSetMatchQuery(const char *query) {
+  free(E.match_query);
+  E.match_query = strdup(query);
+  if (++E.match_gen == 0) E.match_gen = 1;
+  if (E.match_all) E.fullredraw = 1;
+}
+
+void editorToggleMatchAll() {
+  if (E.match_query == NULL) {
+    editorSetStatusMessage("Nothing to highlight: search with Ctrl-F first");
+    return;
+  }
+  E.match_all = !E.match_all;
+  E.fullredraw = 1;
+  editorSetStatusMessage("Highlight all \"%s\" %s", E.match_query,
+                         E.match_all ? "on" : "off");
+}
+
+void editorFind() {
+  int saved_cx = E.cx;
+  int saved_cy = E.cy;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
+
+  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)",
+                             editorFindCallback);
+
+  if (query) {
+    editorSetMatchQuery(query);
+    free(query);
+  } else {
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+}
+
+/*** project search ***/
+
+/* Searches every file under the current directory. Each worker owns a deque
+ * of paths (directories and files): it pops from the tail of its own deque
+ * and steals from the head of the others when it runs dry. Files are
+ * mmap'd and scanned with editorFindMatch, and hits stream into the results
+ * buffer while the search runs. */
+
+struct grepDeque {
+  pthread_mutex_t lock;
+  char **items;
+  int head;
+  int tail;
+  int cap;
+};
+
+struct grepPool {
+  struct grepDeque *deques;
+  int nworkers;
+  const char *query;
+  int qlen;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  unsigned long pushes;
+  int pending;
+  int running;
+  long long nfiles;
+  struct grepHit *hits;
+  int nhits;
+  int hitcap;
+};
+
+struct grepWorker {
+  struct grepPool *pool;
+  int id;
+};
+
+void grepPush(struct grepPool *pool, int id, char *path) {
+  struct grepDeque *dq = &pool->deques[id];
+
+  pthread_mutex_lock(&pool->lock);
+  pool->pending++;
+  pthread_mutex_unlock(&pool->lock);
+
+  pthread_mutex_lock(&dq->lock);
+  if (dq->tail == dq->cap) {
+    if (dq->head > 0) {
+      memmove(dq->items, &dq->items[dq->head],
+              sizeof(char *) * (dq->tail - dq->head));
+      dq->tail -= dq->head;
+      dq->head = 0;
+    }
+    if (dq->tail == dq->cap) {
+      dq->cap = dq->cap ? dq->cap * 2 : 64;
+      dq->items = realloc(dq->items, sizeof(char *) * dq->cap);
+    }
+  }
+  dq->items[dq->tail++] = path;
+  pthread_mutex_unlock(&dq->lock);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->pushes++;
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+char *grepTake(struct grepPool *pool, int id) {
+  char *path = NULL;
+  struct grepDeque *dq = &pool->deques[id];
+
+  pthread_mutex_lock(&dq->lock);
+  if (dq->tail > dq->head) path = dq->items[--dq->tail];
+  pthread_mutex_unlock(&dq->lock);
+
+  for (int k = 1; path == NULL && k < pool->nworkers; k++) {
+    dq = &pool->deques[(id + k) % pool->nworkers];
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head) path = dq->items[dq->head++];
+    pthread_mutex_unlock(&dq->lock);
+  }
+  return path;
+}
+
+void grepAddHit(struct grepPool *pool, const char *path, int line, int col,
+                const char *text, int textlen) {
+  pthread_mutex_lock(&pool->lock);
+  if (pool->nhits == pool->hitcap) {
+    pool->hitcap = pool->hitcap ? pool->hitcap * 2 : 256;
+    pool->hits = realloc(pool->hits, sizeof(struct grepHit) * pool->hitcap);
+  }
+  struct grepHit *hit = &pool->hits[pool->nhits++];
+  hit->path = strdup(path);
+  hit->line = line;
+  hit->col = col;
+  hit->text = malloc(textlen + 1);
+  memcpy(hit->text, text, textlen);
+  hit->text[textlen] = '\0';
+  hit->textlen = textlen;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void grepFile(struct grepPool *pool, const char *path, size_t size) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return;
+  char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return;
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  if (memchr(data, '\0', size < 8192 ? size : 8192) == NULL) {
+    const char *p = data, *end = data + size;
+    const char *counted = data;
+    int line = 1;
+    char *match;
+    while ((match = editorFindMatch(p, end - p, pool->query, pool->qlen))) {
+      const char *nl;
+      while ((nl = memchr(counted, '\n', match - counted)) != NULL) {
+        line++;
+        counted = nl + 1;
+      }
+      const char *eol = memchr(match, '\n', end - match);
+      if (eol == NULL) eol = end;
+      int textlen = eol - counted;
+      if (textlen > 0 && counted[textlen - 1] == '\r') textlen--;
+      grepAddHit(pool, path, line, match - counted, counted, textlen);
+      p = eol;
+    }
+  }
+  munmap(data, size);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->nfiles++;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void grepVisit(struct grepPool *pool, int id, const char *path) {
+  struct stat st;
+  if (lstat(path, &st) == -1) return;
+
+  if (S_ISREG(st.st_mode)) {
+    if (st.st_size > 0) grepFile(pool, path, st.st_size);
+    return;
+  }
+  if (!S_ISDIR(st.st_mode)) return;
+
+  DIR *dp = opendir(path);
+  if (dp == NULL) return;
+  struct dirent *de;
+  while ((de = readdir(dp)) != NULL) {
+    if (de->d_name[0] == '.') continue;
+    char *child = malloc(strlen(path) + strlen(de->d_name) + 2);
+    if (!strcmp(path, ".")) strcpy(child, de->d_name);
+    else sprintf(child, "%s/%s", path, de->d_name);
+    grepPush(pool, id, child);
+  }
+  closedir(dp);
+}
+
+void *grepWork(void *arg) {
+  struct grepWorker *w = arg;
+  struct grepPool *pool = w->pool;
+
+  while (1) {
+    /* a push after this snapshot bumps pool->pushes, so the wait below
+     * cannot miss it */
+    pthread_mutex_lock(&pool->lock);
+    unsigned long seen = pool->pushes;
+    pthread_mutex_unlock(&pool->lock);
+
+    char *path = grepTake(pool, w->id);
+    if (path == NULL) {
+      pthread_mutex_lock(&pool->lock);
+      while (pool->pending > 0 && pool->pushes == seen)
+        pthread_cond_wait(&pool->work, &pool->lock);
+      int idle = pool->pending == 0;
+      pthread_mutex_unlock(&pool->lock);
+      if (idle) break;
+      continue;
+    }
+    grepVisit(pool, w->id, path);
+    free(path);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0) pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->running--;
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+/* Moves hits found so far into the results buffer as rows. */
+void grepCollect(struct grepPool *pool) {
+  struct grepResults *res = E.results;
+
+  pthread_mutex_lock(&pool->lock);
+  int nhits = pool->nhits;
+  res->hits = realloc(res->hits, sizeof(struct grepHit) * (nhits + 1));
+  if (nhits > res->nhits)
+    memcpy(&res->hits[res->nhits], &pool->hits[res->nhits],
+           sizeof(struct grepHit) * (nhits - res->nhits));
+  pthread_mutex_unlock(&pool->lock);
+
+  for (; res->nhits < nhits; res->nhits++) {
+    struct grepHit *hit = &res->hits[res->nhits];
+    char prefix[64];
+    int plen = snprintf(prefix, sizeof(prefix), ":%d: ", hit->line);
+    int pathlen = strlen(hit->path);
+    char *line = malloc(pathlen + plen + hit->textlen);
+    memcpy(line, hit->path, pathlen);
+    memcpy(&line[pathlen], prefix, plen);
+    memcpy(&line[pathlen + plen], hit->text, hit->textlen);
+    editorInsertRow(E.numrows, line, pathlen + plen + hit->textlen);
+    free(line);
+  }
+}
+
+void editorGrep() {
+  char *query = editorPrompt("Grep: %s (ESC to cancel)", NULL);
+  if (query == NULL) return;
+
+  if (E.results) editorFreeBuffer();
+  else editorBufferFresh();
+  E.results = calloc(1, sizeof(struct grepResults));
+  E.results->query = query;
+
+  struct grepPool pool;
+  memset(&pool, 0, sizeof(pool));
+  pool.query = query;
+  pool.qlen = strlen(query);
+  pool.nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (pool.nworkers < 1) pool.nworkers = 1;
+  pool.running = pool.nworkers;
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.work, NULL);
+  pool.deques = calloc(pool.nworkers, sizeof(struct grepDeque));
+  for (int i = 0; i < pool.nworkers; i++)
+    pthread_mutex_init(&pool.deques[i].lock, NULL);
+  grepPush(&pool, 0, strdup("."));
+
+  pthread_t *threads = malloc(sizeof(pthread_t) * pool.nworkers);
+  struct grepWorker *workers = malloc(sizeof(struct grepWorker) *
+                                      pool.nworkers);
+  for (int i = 0; i < pool.nworkers; i++) {
+    workers[i].pool = &pool;
+    workers[i].id = i;
+    if (pthread_create(&threads[i], NULL, grepWork, &workers[i]) != 0)
+      die("pthread_create");
+  }
+
+  /* once running reaches 0 every worker is done, so the nfiles read in the
+   * same critical section is the final count */
+  int running;
+  long long nfiles;
+  do {
+    struct timespec ts = { 0, 50 * 1000000 };
+    nanosleep(&ts, NULL);
+
+    pthread_mutex_lock(&pool.lock);
+    running = pool.running;
+    nfiles = pool.nfiles;
+    pthread_mutex_unlock(&pool.lock);
+
+    grepCollect(&pool);
+    editorSetStatusMessage("Searching... %lld files, %d matches",
+                           nfiles, E.results->nhits);
+    editorRefreshScreen();
+  } while (running > 0);
+
+  for (int i = 0; i < pool.nworkers; i++) {
+    pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pool.deques[i].lock);
+    free(pool.deques[i].items);
+  }
+  grepCollect(&pool);
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.work);
+  free(pool.deques);
+  free(pool.hits);
+  free(threads);
+  free(workers);
+
+  E.dirty = 0;
+  editorSetStatusMessage("%d matches in %lld files (Enter to open)",
+                         E.results->nhits, nfiles);
+}
+
+void editorGrepOpenHit() {
+  if (E.cy >= E.results->nhits) return;
+  struct grepHit *hit = &E.results->hits[E.cy];
+
+  if (access(hit->path, R_OK) == -1) {
+    editorSetStatusMessage("Can't open %s: %s", hit->path, strerror(errno));
+    return;
+  }
+
+  char *path = strdup(hit->path);
+  int line = hit->line;
+  int col = hit->col;
+
+  int opened = editorBufferOpen(path);
+  free(path);
+  if (opened == -1) return;
+
+  E.cy = line - 1 < E.numrows ? line - 1 : E.numrows;
+  E.cx = E.cy < E.numrows && col <= E.row[E.cy].size ? col : 0;
+}
+
+/* Keys in the read-only results buffer: Enter opens the hit under the
+ * cursor; navigation, quit, buffer and grep keys get through (return 0);
+ * everything else is swallowed. */
+int editorGrepKey(int c) {
+  switch (c) {
+    case '\r':
+      editorGrepOpenHit();
+      return 1;
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+    case PAGE_UP:
+    case PAGE_DOWN:
+    case HOME_KEY:
+    case END_KEY:
+    case CTRL_KEY('f'):
+    case CTRL_KEY('g'):
+    case CTRL_KEY('q'):
+    case CTRL_KEY('o'):
+    case CTRL_KEY('b'):
+    case CTRL_KEY('t'):
+      return 0;
+    default:
+      return 1;
+  }
+}
+
+/*** syntax cache ***/
+
+/* Syntax definitions are read from SYNTAX_FILE_EXT files in the syntax
+ * directory and compiled, together with HLDB, into one flat image holding
+ * the keyword hash tables, separator classes and a filetype hash map. The
+ * image is written next to the directory and mmap'd on later startups. */
+
+struct syncacheHeader {
+  char magic[8];
+  uint64_t signature;
+  uint32_t size;
+  uint32_t nsyntax;
+  uint32_t syntax_off;
+  uint32_t extmask;
+  uint32_t ext_off;
+  uint32_t npatterns;
+  uint32_t pattern_off;
+  uint32_t pad;
+};
+
+struct syncacheSyntax {
+  uint32_t filetype;
+  uint32_t scs;
+  uint32_t mcs;
+  uint32_t mce;
+  uint32_t flags;
+  uint32_t kwmask;
+  uint32_t kw_off;
+  uint32_t sep_off;
+};
+
+struct syncacheMatch {
+  uint32_t str;
+  uint32_t syntax;
+};
+
+uint32_t syncacheAppend(struct abuf *ab, const void *data, int len) {
+  static const char zeros[8];
+  while (ab->len % 8) abAppend(ab, zeros, 8 - ab->len % 8);
+  uint32_t off = ab->len;
+  abAppend(ab, data, len);
+  return off;
+}
+
+uint32_t syncacheString(struct abuf *ab, const char *s, int len) {
+  if (s == NULL) return 0;
+  uint32_t off = ab->len;
+  abAppend(ab, s, len);
+  abAppend(ab, "", 1);
+  return off;
+}
+
+uint32_t syncacheTableMask(int n) {
+  uint32_t size = 8;
+  while (size < (uint32_t)n * 2) size *= 2;
+  return size - 1;
+}
+
+char *syncacheCompile(struct editorSyntax **defs, int ndefs, uint64_t signature,
+                      size_t *size) {
+  struct abuf ab = ABUF_INIT;
+  struct syncacheHeader hdr;
+  struct syncacheSyntax *syn = calloc(ndefs, sizeof(*syn));
+  int nexts = 0, npatterns = 0;
+  int i, j;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SYNCACHE_MAGIC, 8);
+  hdr.signature = signature;
+  hdr.nsyntax = ndefs;
+
+  /* offset 0 holds the header, so a zero string offset means "none" */
+  syncacheAppend(&ab, &hdr, sizeof(hdr));
+
+  for (i = 0; i < ndefs; i++) {
+    struct editorSyntax *d = defs[i];
+    char *s;
+
+    syn[i].filetype = syncacheString(&ab, d->filetype, strlen(d->filetype));
+    s = d->singleline_comment_start;
+    syn[i].scs = syncacheString(&ab, s, s ? (int)strlen(s) : 0);
+    s = d->multiline_comment_start;
+    syn[i].mcs = syncacheString(&ab, s, s ? (int)strlen(s) : 0);
+    s = d->multiline_comment_end;
+    syn[i].mce = syncacheString(&ab, s, s ? (int)strlen(s) : 0);
+    syn[i].flags = d->flags;
+
+    int nkw = 0;
+    while (d->keywords[nkw]) nkw++;
+    syn[i].kwmask = syncacheTableMask(nkw);
+    struct synKeyword *kwtable = calloc(syn[i].kwmask + 1, sizeof(*kwtable));
+    for (j = 0; j < nkw; j++) {
+      int klen = strlen(d->keywords[j]);
+      int kw2 = klen > 0 && d->keywords[j][klen - 1] == '|';
+      if (kw2) klen--;
+      if (klen == 0 || klen > 0xffff) continue;
+
+      uint32_t h = syntaxHash(d->keywords[j], klen);
+      uint32_t k = h & syn[i].kwmask;
+      while (kwtable[k].len) k = (k + 1) & syn[i].kwmask;
+      kwtable[k].hash = h;
+      kwtable[k].str = syncacheString(&ab, d->keywords[j], klen);
+      kwtable[k].len = klen;
+      kwtable[k].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+    }
+    syn[i].kw_off = syncacheAppend(&ab, kwtable,
+                                   (syn[i].kwmask + 1) * sizeof(*kwtable));
+    free(kwtable);
+
+    unsigned char sep[256];
+    for (j = 0; j < 256; j++) sep[j] = is_separator(j) != 0;
+    syn[i].sep_off = syncacheAppend(&ab, sep, sizeof(sep));
+
+    for (j = 0; d->filematch[j]; j++) {
+      if (d->filematch[j][0] == '.') nexts++;
+      else npatterns++;
+    }
+  }
+
+  hdr.extmask = syncacheTableMask(nexts);
+  struct syncacheMatch *exts = calloc(hdr.extmask + 1, sizeof(*exts));
+  struct syncacheMatch *patterns = calloc(npatterns + 1, sizeof(*patterns));
+  npatterns = 0;
+  for (i = 0; i < ndefs; i++) {
+    for (j = 0; defs[i]->filematch[j]; j++) {
+      char *m = defs[i]->filematch[j];
+      int mlen = strlen(m);
+      if (m[0] != '.') {
+        patterns[npatterns].str = syncacheString(&ab, m, mlen);
+        patterns[npatterns++].syntax = i;
+        continue;
+      }
+
+      uint32_t k = syntaxHash(m, mlen) & hdr.extmask;
+      while (exts[k].str && strcmp(&ab.b[exts[k].str], m))
+        k = (k + 1) & hdr.extmask;
+      if (exts[k].str) continue;
+      exts[k].str = syncacheString(&ab, m, mlen);
+      exts[k].syntax = i;
+    }
+  }
+  hdr.ext_off = syncacheAppend(&ab, exts, (hdr.extmask + 1) * sizeof(*exts));
+  hdr.npatterns = npatterns;
+  hdr.pattern_off = syncacheAppend(&ab, patterns,
+                                   npatterns * sizeof(*patterns));
+  hdr.syntax_off = syncacheAppend(&ab, syn, ndefs * sizeof(*syn));
+  hdr.size = ab.len;
+  memcpy(ab.b, &hdr, sizeof(hdr));
+
+  free(exts);
+  free(patterns);
+  free(syn);
+  *size = ab.len;
+  return ab.b;
+}
+
+void syntaxFreeDef(struct editorSyntax *d) {
+  int j;
+  free(d->filetype);
+  for (j = 0; d->filematch[j]; j++) free(d->filematch[j]);
+  free(d->filematch);
+  for (j = 0; d->keywords[j]; j++) free(d->keywords[j]);
+  free(d->keywords);
+  free(d->singleline_comment_start);
+  free(d->multiline_comment_start);
+  free(d->multiline_comment_end);
+  free(d);
+}
+
+void syntaxListAppend(char ***list, int *len, const char *s, int kw2) {
+  *list = realloc(*list, sizeof(char *) * (*len + 2));
+  (*list)[*len] = malloc(strlen(s) + 2);
+  strcpy((*list)[*len], s);
+  if (kw2) strcat((*list)[*len], "|");
+  (*len)++;
+  (*list)[*len] = NULL;
+}
+
+/* Parses a definition file made of "key value..." lines:
+ *
+ *   filetype python
+ *   filematch .py .pyw
+ *   keywords if else while for
+ *   types int str float
+ *   comment #
+ *   multiline """ """
+ *   flags numbers strings
+ */
+struct editorSyntax *syntaxParseFile(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) return NULL;
+
+  struct editorSyntax *d = calloc(1, sizeof(*d));
+  int nmatch = 0, nkw = 0;
+  d->filematch = calloc(1, sizeof(char *));
+  d->keywords = calloc(1, sizeof(char *));
+
+  char *line = NULL;
+  size_t linecap = 0;
+  while (getline(&line, &linecap, fp) != -1) {
+    char *key = strtok(line, " \t\r\n");
+    if (key == NULL || key[0] == '#') continue;
+
+    char *val;
+    while ((val = strtok(NULL, " \t\r\n")) != NULL) {
+      if (!strcmp(key, "filetype")) {
+        free(d->filetype);
+        d->filetype = strdup(val);
+      } else if (!strcmp(key, "filematch")) {
+        syntaxListAppend(&d->filematch, &nmatch, val, 0);
+      } else if (!strcmp(key, "keywords")) {
+        syntaxListAppend(&d->keywords, &nkw, val, 0);
+      } else if (!strcmp(key, "types")) {
+        syntaxListAppend(&d->keywords, &nkw, val, 1);
+      } else if (!strcmp(key, "comment")) {
+        free(d->singleline_comment_start);
+        d->singleline_comment_start = strdup(val);
+      } else if (!strcmp(key, "multiline")) {
+        if (d->multiline_comment_start && !d->multiline_comment_end) {
+          d->multiline_comment_end = strdup(val);
+        } else {
+          free(d->multiline_comment_start);
+          free(d->multiline_comment_end);
+          d->multiline_comment_start = strdup(val);
+          d->multiline_comment_end = NULL;
+        }
+      } else if (!strcmp(key, "flags")) {
+        if (!strcmp(val, "numbers")) d->flags |= HL_HIGHLIGHT_NUMBERS;
+        else if (!strcmp(val, "strings")) d->flags |= HL_HIGHLIGHT_STRINGS;
+      }
+    }
+  }
+  free(line);
+  fclose(fp);
+
+  if (d->filetype == NULL) {
+    syntaxFreeDef(d);
+    return NULL;
+  }
+  if (d->multiline_comment_end == NULL) {
+    free(d->multiline_comment_start);
+    d->multiline_comment_start = NULL;
+  }
+  return d;
+}
+
+int syntaxCompareNames(const void *a, const void *b) {
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+uint64_t syncacheFold(uint64_t h, const void *data, size_t len) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 1099511628211ull;
+  return h;
+}
+
+/* Strings are folded with their terminator so that adjacent ones cannot
+ * run together; a missing one folds as a single 0xff byte. */
+uint64_t syncacheFoldString(uint64_t h, const char *s) {
+  if (s == NULL) return syncacheFold(h, "\xff", 1);
+  return syncacheFold(h, s, strlen(s) + 1);
+}
+
+/* Folds everything compiled into the image that comes from this binary
+ * rather than from the definition files: HLDB and the separator class. */
+uint64_t syncacheFoldBuiltins(uint64_t h) {
+  unsigned char sep[256];
+  unsigned int i;
+  int j;
+  for (j = 0; j < 256; j++) sep[j] = is_separator(j) != 0;
+  h = syncacheFold(h, sep, sizeof(sep));
+
+  for (i = 0; i < HLDB_ENTRIES; i++) {
+    struct editorSyntax *d = &HLDB[i];
+    uint32_t flags = d->flags;
+    h = syncacheFoldString(h, d->filetype);
+    for (j = 0; d->filematch[j]; j++) h = syncacheFoldString(h, d->filematch[j]);
+    h = syncacheFoldString(h, NULL);
+    for (j = 0; d->keywords[j]; j++) h = syncacheFoldString(h, d->keywords[j]);
+    h = syncacheFoldString(h, NULL);
+    h = syncacheFoldString(h, d->singleline_comment_start);
+    h = syncacheFoldString(h, d->multiline_comment_start);
+    h = syncacheFoldString(h, d->multiline_comment_end);
+    h = syncacheFold(h, &flags, sizeof(flags));
+  }
+  return h;
+}
+
+/* Lists the definition files in `dir` (sorted) and folds their names, sizes
+ * and mtimes, along with the built-in definitions, into a signature used to
+ * validate the compiled cache. */
+int syntaxListDir(const char *dir, char ***paths, uint64_t *signature) {
+  uint64_t h = 14695981039346656037ull;
+  int n = 0;
+  h = syncacheFoldString(h, SYNCACHE_MAGIC KILO_VERSION);
+  h = syncacheFoldBuiltins(h);
+
+  *paths = NULL;
+  DIR *dp = dir ? opendir(dir) : NULL;
+  if (dp) {
+    struct dirent *de;
+    int extlen = strlen(SYNTAX_FILE_EXT);
+    while ((de = readdir(dp)) != NULL) {
+      int len = strlen(de->d_name);
+      if (len <= extlen || strcmp(&de->d_name[len - extlen], SYNTAX_FILE_EXT))
+        continue;
+      *paths = realloc(*paths, sizeof(char *) * (n + 1));
+      (*paths)[n] = malloc(strlen(dir) + len + 2);
+      sprintf((*paths)[n], "%s/%s", dir, de->d_name);
+      n++;
+    }
+    closedir(dp);
+  }
+  if (n) qsort(*paths, n, sizeof(char *), syntaxCompareNames);
+
+  for (int i = 0; i < n; i++) {
+    struct stat st;
+    uint64_t vals[2] = {0, 0};
+    if (stat((*paths)[i], &st) == 0) {
+      vals[0] = st.st_size;
+      vals[1] = st.st_mtime;
+    }
+    h = syncacheFoldString(h, (*paths)[i]);
+    h = syncacheFold(h, vals, sizeof(vals));
+  }
+
+  *signature = h;
+  return n;
+}
+
+/* The cache file is only trusted as far as its signature; every offset in
+ * it is checked against the image size before anything is dereferenced. */
+
+int syncacheRange(size_t size, uint32_t off, uint64_t len) {
+  return off % 8 == 0 && off <= size && len <= size - off;
+}
 
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numrows;
+int syncacheStringOk(const char *image, size_t size, uint32_t off) {
+  return off >= sizeof(struct syncacheHeader) && off < size &&
+         memchr(&image[off], '\0', size - off) != NULL;
+}
 
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
+/* A probe table needs a power-of-two size and at least one empty slot, or
+ * lookups would never terminate. */
+int syncacheMaskOk(uint32_t mask) {
+  return (mask & (mask + 1ull)) == 0;
+}
+
+int syncacheMatchesOk(const char *image, size_t size, uint32_t off,
+                      uint64_t n, uint32_t nsyntax, int table) {
+  if (!syncacheRange(size, off, n * sizeof(struct syncacheMatch))) return 0;
+  const struct syncacheMatch *m = (const struct syncacheMatch *)&image[off];
+  uint64_t empty = 0;
+  for (uint64_t i = 0; i < n; i++) {
+    if (table && m[i].str == 0) {
+      empty++;
+      continue;
     }
+    if (!syncacheStringOk(image, size, m[i].str) || m[i].syntax >= nsyntax)
+      return 0;
   }
+  return !table || empty > 0;
 }
 
-void editorFind() {
-  int saved_cx = E.cx;
-  int saved_cy = E.cy;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
+int syncacheValid(const char *image, size_t size) {
+  const struct syncacheHeader *hdr = (const struct syncacheHeader *)image;
+  uint32_t i, j;
+
+  if (!syncacheRange(size, hdr->syntax_off,
+                     (uint64_t)hdr->nsyntax * sizeof(struct syncacheSyntax)) ||
+      !syncacheMaskOk(hdr->extmask) ||
+      !syncacheMatchesOk(image, size, hdr->ext_off, hdr->extmask + 1ull,
+                         hdr->nsyntax, 1) ||
+      !syncacheMatchesOk(image, size, hdr->pattern_off, hdr->npatterns,
+                         hdr->nsyntax, 0))
+    return 0;
 
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)",
-                             editorFindCallback);
+  const struct syncacheSyntax *syn =
+    (const struct syncacheSyntax *)&image[hdr->syntax_off];
+  for (i = 0; i < hdr->nsyntax; i++) {
+    if (!syncacheStringOk(image, size, syn[i].filetype) ||
+        (syn[i].scs && !syncacheStringOk(image, size, syn[i].scs)) ||
+        (syn[i].mcs && !syncacheStringOk(image, size, syn[i].mcs)) ||
+        (syn[i].mce && !syncacheStringOk(image, size, syn[i].mce)) ||
+        !syncacheRange(size, syn[i].sep_off, 256) ||
+        !syncacheMaskOk(syn[i].kwmask) ||
+        !syncacheRange(size, syn[i].kw_off,
+                       (syn[i].kwmask + 1ull) * sizeof(struct synKeyword)))
+      return 0;
+
+    const struct synKeyword *kw =
+      (const struct synKeyword *)&image[syn[i].kw_off];
+    uint32_t empty = 0;
+    for (j = 0; j <= syn[i].kwmask; j++) {
+      if (kw[j].len == 0) {
+        empty++;
+        continue;
+      }
+      if (kw[j].str > size || kw[j].len > size - kw[j].str ||
+          (kw[j].hl != HL_KEYWORD1 && kw[j].hl != HL_KEYWORD2))
+        return 0;
+    }
+    if (empty == 0) return 0;
+  }
+  return 1;
+}
 
-  if (query) {
-    free(query);
-  } else {
-    E.cx = saved_cx;
-    E.cy = saved_cy;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+char *syncacheMap(const char *path, uint64_t signature, size_t *size) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return NULL;
+
+  struct stat st;
+  char *image = NULL;
+  if (fstat(fd, &st) == 0 &&
+      st.st_size >= (off_t)sizeof(struct syncacheHeader)) {
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED) image = NULL;
+  }
+  close(fd);
+  if (image == NULL) return NULL;
+
+  struct syncacheHeader *hdr = (struct syncacheHeader *)image;
+  if (memcmp(hdr->magic, SYNCACHE_MAGIC, 8) || hdr->signature != signature ||
+      hdr->size != (uint64_t)st.st_size ||
+      !syncacheValid(image, st.st_size)) {
+    munmap(image, st.st_size);
+    return NULL;
   }
+  *size = st.st_size;
+  return image;
 }
 
-/*** append buffer ***/
+void syncacheWrite(const char *path, const char *image, size_t size) {
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) return;
+  int ok = write(fd, image, size) == (ssize_t)size;
+  close(fd);
+  if (!ok || rename(tmp, path) == -1) unlink(tmp);
+}
 
-struct abuf {
-  char *b;
-  int len;
-};
+void syntaxDBLoad(struct syntaxDB *db) {
+  char dir[4096];
+  char cache[4096 + 8];
+  const char *env = getenv("KILO_SYNTAX_DIR");
+  const char *home = getenv("HOME");
+  int have_dir = 1;
+
+  if (env) snprintf(dir, sizeof(dir), "%s", env);
+  else if (home) snprintf(dir, sizeof(dir), "%s/.kilo/syntax", home);
+  else have_dir = 0;
+
+  char **paths;
+  uint64_t signature;
+  int npaths = syntaxListDir(have_dir ? dir : NULL, &paths, &signature);
+  if (npaths == 0) have_dir = 0;
+  if (have_dir) snprintf(cache, sizeof(cache), "%s.cache", dir);
+
+  db->image = have_dir ? syncacheMap(cache, signature, &db->size) : NULL;
+  db->mapped = db->image != NULL;
+
+  if (db->image == NULL) {
+    struct editorSyntax **defs = malloc(sizeof(*defs) * (npaths + HLDB_ENTRIES));
+    int ndefs = 0;
+    int nparsed;
+    unsigned int j;
+    for (int i = 0; i < npaths; i++) {
+      struct editorSyntax *d = syntaxParseFile(paths[i]);
+      if (d) defs[ndefs++] = d;
+    }
+    nparsed = ndefs;
+    for (j = 0; j < HLDB_ENTRIES; j++) defs[ndefs++] = &HLDB[j];
 
-#define ABUF_INIT {NULL, 0}
+    db->image = syncacheCompile(defs, ndefs, signature, &db->size);
+    if (have_dir) syncacheWrite(cache, db->image, db->size);
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
+    for (int i = 0; i < nparsed; i++) syntaxFreeDef(defs[i]);
+    free(defs);
+  }
 
-  if (new == NULL) return;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
-  ab->len += len;
+  for (int i = 0; i < npaths; i++) free(paths[i]);
+  free(paths);
+
+  struct syncacheHeader *hdr = (struct syncacheHeader *)db->image;
+  struct syncacheSyntax *syn =
+    (struct syncacheSyntax *)&db->image[hdr->syntax_off];
+  db->nsyntax = hdr->nsyntax;
+  db->syntax = calloc(db->nsyntax, sizeof(struct editorSyntax));
+  for (int i = 0; i < db->nsyntax; i++) {
+    struct editorSyntax *s = &db->syntax[i];
+    s->filetype = &db->image[syn[i].filetype];
+    s->singleline_comment_start = syn[i].scs ? &db->image[syn[i].scs] : NULL;
+    s->multiline_comment_start = syn[i].mcs ? &db->image[syn[i].mcs] : NULL;
+    s->multiline_comment_end = syn[i].mce ? &db->image[syn[i].mce] : NULL;
+    s->flags = syn[i].flags;
+    s->kwtable = (const struct synKeyword *)&db->image[syn[i].kw_off];
+    s->kwmask = syn[i].kwmask;
+    s->strings = db->image;
+    s->separators = (const unsigned char *)&db->image[syn[i].sep_off];
+  }
 }
 
-void abFree(struct abuf *ab) {
-  free(ab->b);
+struct editorSyntax *syntaxDBMatch(struct syntaxDB *db, const char *filename) {
+  if (db->image == NULL) return NULL;
+  struct syncacheHeader *hdr = (struct syncacheHeader *)db->image;
+
+  const char *ext = strrchr(filename, '.');
+  if (ext) {
+    const struct syncacheMatch *exts =
+      (const struct syncacheMatch *)&db->image[hdr->ext_off];
+    uint32_t k = syntaxHash(ext, strlen(ext)) & hdr->extmask;
+    for (; exts[k].str; k = (k + 1) & hdr->extmask) {
+      if (!strcmp(&db->image[exts[k].str], ext))
+        return &db->syntax[exts[k].syntax];
+    }
+  }
+
+  const struct syncacheMatch *patterns =
+    (const struct syncacheMatch *)&db->image[hdr->pattern_off];
+  for (uint32_t i = 0; i < hdr->npatterns; i++) {
+    if (strstr(filename, &db->image[patterns[i].str]))
+      return &db->syntax[patterns[i].syntax];
+  }
+  return NULL;
 }
 
 /*** output ***/
 
 void editorScroll() {
+  if (E.hex.fd != -1) {
+    editorHexScroll();
+    return;
+  }
+
   E.rx = 0;
   if (E.cy < E.numrows) {
     E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
   }
 
+  if (E.softwrap) {
+    E.coloff = 0;
+    if (E.vrowoff < 0) E.vrowoff = editorWrapLine(E.rowoff);
+    /* a cursor just past the end of a row that fills its last line stays
+     * on that line, in the last column */
+    int sub = E.rx / E.screencols;
+    E.vcursor_col = E.rx % E.screencols;
+    if (E.cy < E.numrows &&
+        sub >= editorRowWraps(&E.row[E.cy], E.screencols)) {
+      sub--;
+      E.vcursor_col = E.screencols - 1;
+    }
+    E.vcursor = editorWrapLine(E.cy) + sub;
+    if (E.vcursor < E.vrowoff) {
+      E.vrowoff = E.vcursor;
+    }
+    if (E.vcursor >= E.vrowoff + E.screenrows) {
+      E.vrowoff = E.vcursor - E.screenrows + 1;
+    }
+    E.rowoff = editorWrapRow(E.vrowoff, &sub);
+    return;
+  }
+
   if (E.cy < E.rowoff) {
     E.rowoff = E.cy;
   }
@@ -743,10 +4078,56 @@ void editorScroll() {
   }
 }
 
+/* Writes a run of cells, emitting the theme's precomputed sequence only
+ * where the highlight class changes. */
+void editorDrawRowSegment(struct abuf *ab, erow *row, int start, int len) {
+  struct editorTheme *t = &E.theme;
+  char *c = &row->render[start];
+  unsigned char *hl = &row->hl[start];
+  int current = t->plain_normal ? HL_NORMAL : -1;
+  int j;
+
+  int m = 0;
+  if (E.match_all) {
+    editorRowMatches(row);
+    while (m < row->nmatches && row->matches[2 * m + 1] <= start) m++;
+  }
+
+  for (j = 0; j < len; j++) {
+    int h = hl[j];
+    if (m < row->nmatches && E.match_all) {
+      while (m < row->nmatches && row->matches[2 * m + 1] <= start + j) m++;
+      if (m < row->nmatches && row->matches[2 * m] <= start + j) h = HL_MATCH;
+    }
+    if (iscntrl(c[j])) {
+      char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+      abAppend(ab, "\x1b[7m", 4);
+      abAppend(ab, &sym, 1);
+      abAppend(ab, "\x1b[m", 3);
+      current = t->plain_normal ? HL_NORMAL : -1;
+    } else {
+      if (h != current) {
+        abAppend(ab, t->sgr[h], t->sgrlen[h]);
+        current = h;
+      }
+      abAppend(ab, &c[j], 1);
+    }
+  }
+  abAppend(ab, t->reset, t->resetlen);
+}
+
 void editorDrawRows(struct abuf *ab) {
+  if (E.hex.fd != -1) {
+    editorHexDraw(ab);
+    return;
+  }
+
   int y;
+  int sub = 0;
+  int filerow = E.rowoff;
+  if (E.softwrap) filerow = editorWrapRow(E.vrowoff, &sub);
+
   for (y = 0; y < E.screenrows; y++) {
-    int filerow = y + E.rowoff;
     if (filerow >= E.numrows) {
       if (E.numrows == 0 && y == E.screenrows / 3) {
         char welcome[80];
@@ -764,43 +4145,21 @@ void editorDrawRows(struct abuf *ab) {
         abAppend(ab, "~", 1);
       }
     } else {
-      int len = E.row[filerow].rsize - E.coloff;
+      erow *row = &E.row[filerow];
+      editorRowRender(row);
+      int start = E.softwrap ? sub * E.screencols : E.coloff;
+      int len = row->rsize - start;
       if (len < 0) len = 0;
       if (len > E.screencols) len = E.screencols;
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      int current_color = -1;
-      int j;
-      for (j = 0; j < len; j++) {
-        if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
-        } else {
-          int color = editorSyntaxToColor(hl[j]);
-          if (color != current_color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
-        }
+      editorDrawRowSegment(ab, row, start, len);
+
+      if (E.softwrap && ++sub < editorRowWraps(row, E.screencols)) {
+        filerow--;
+      } else {
+        sub = 0;
       }
-      abAppend(ab, "\x1b[39m", 5);
     }
+    filerow++;
 
     abAppend(ab, "\x1b[K", 3);
     abAppend(ab, "\r\n", 2);
@@ -811,10 +4170,21 @@ void editorDrawStatusBar(struct abuf *ab) {
   abAppend(ab, "\x1b[7m", 4);
   char status[80], rstatus[80];
   int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-    E.filename ? E.filename : "[No Name]", E.numrows,
+    E.results ? "*grep*" : E.filename ? E.filename : "[No Name]", E.numrows,
     E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-    E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+  int rlen;
+  if (E.hex.fd != -1) {
+    len = snprintf(status, sizeof(status), "%.20s - hex (read-only)",
+                   E.filename);
+    rlen = snprintf(rstatus, sizeof(rstatus), "0x%llx | byte %lld of %lld",
+                    E.hex.cur, E.hex.cur, E.file_size);
+  } else {
+    long long offset = editorRowOffset(E.cy);
+    if (E.cy < E.numrows) offset += E.cx;
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d | byte %lld of %lld",
+      E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows,
+      offset, editorRowOffset(E.numrows));
+  }
   if (len > E.screencols) len = E.screencols;
   abAppend(ab, status, len);
   while (len < E.screencols) {
@@ -838,6 +4208,25 @@ void editorDrawMessageBar(struct abuf *ab) {
     abAppend(ab, E.statusmsg, msglen);
 }
 
+void editorDrawCursor(struct abuf *ab) {
+  char buf[32];
+  if (E.hex.fd != -1) {
+    editorHexDrawCursor(ab);
+    abAppend(ab, "\x1b[?25h", 6);
+    return;
+  }
+  if (E.softwrap) {
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (int)(E.vcursor - E.vrowoff) + 1,
+                                              E.vcursor_col + 1);
+  } else {
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
+                                              (E.rx - E.coloff) + 1);
+  }
+  abAppend(ab, buf, strlen(buf));
+
+  abAppend(ab, "\x1b[?25h", 6);
+}
+
 void editorRefreshScreen() {
   editorScroll();
 
@@ -849,15 +4238,34 @@ void editorRefreshScreen() {
   editorDrawRows(&ab);
   editorDrawStatusBar(&ab);
   editorDrawMessageBar(&ab);
+  editorDrawCursor(&ab);
+
+  editorOutput(ab.b, ab.len);
+  abFree(&ab);
+
+  E.fullredraw = 0;
+  E.frame_rowoff = E.rowoff;
+  E.frame_coloff = E.coloff;
+  E.frame_vrowoff = E.vrowoff;
+  E.frame_hextop = E.hex.top;
+}
+
+/* Redraws only the status and message bars and moves the cursor, for frames
+ * where nothing in the text area changed. */
+void editorRefreshCursor() {
+  struct abuf ab = ABUF_INIT;
+
+  abAppend(&ab, "\x1b[?25l", 6);
 
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-                                            (E.rx - E.coloff) + 1);
+  snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.screenrows + 1);
   abAppend(&ab, buf, strlen(buf));
 
-  abAppend(&ab, "\x1b[?25h", 6);
+  editorDrawStatusBar(&ab);
+  editorDrawMessageBar(&ab);
+  editorDrawCursor(&ab);
 
-  write(STDOUT_FILENO, ab.b, ab.len);
+  editorOutput(ab.b, ab.len);
   abFree(&ab);
 }
 
@@ -869,6 +4277,412 @@ void editorSetStatusMessage(const char *fmt, ...) {
   E.statusmsg_time = time(NULL);
 }
 
+/*** scheduler ***/
+
+int editorInputPending() {
+  if (E.session.replay) return editorReplayPending();
+  struct pollfd pfds[2] = {
+    { STDIN_FILENO, POLLIN, 0 },
+    { E.winchpipe[0], POLLIN, 0 }
+  };
+  return poll(pfds, E.winchpipe[0] == -1 ? 1 : 2, 0) > 0;
+}
+
+/* Picks up a new window size. Rendered rows and highlighting do not depend
+ * on the width, so only the wrap index (rebuilt lazily when the column count
+ * changed) and the next frame are invalidated. */
+void editorResize() {
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1) return;
+  rows -= 2;
+  if (rows < 1) rows = 1;
+  if (rows == E.screenrows && cols == E.screencols) return;
+  E.screenrows = rows;
+  E.screencols = cols;
+  E.vrowoff = -1;
+  E.fullredraw = 1;
+}
+
+void editorFlushFrame() {
+  if (E.macro.batch) return;
+  editorScroll();
+  if (E.fullredraw || E.rowoff != E.frame_rowoff ||
+      E.coloff != E.frame_coloff || E.vrowoff != E.frame_vrowoff ||
+      E.hex.top != E.frame_hextop) {
+    editorRefreshScreen();
+  } else {
+    editorRefreshCursor();
+  }
+}
+
+/* Processes every key that is already waiting before drawing, but forces a
+ * frame at least every frame_interval while input keeps arriving. */
+void editorRunLoop() {
+  while (1) {
+    editorFlushFrame();
+    editorProcessKeypress();
+
+    long long start = editorNow();
+    while (editorInputPending() && editorNow() - start < E.frame_interval)
+      editorProcessKeypress();
+  }
+}
+
+/*** server ***/
+
+/* In server mode a daemon keeps the buffer loaded and thin clients attach
+ * over a Unix socket. Clients send framed messages (a type byte and a
+ * 16-bit length, then the payload) carrying raw key bytes or their window
+ * size, and receive rendered frames as plain terminal output.
+ *
+ * Client sockets are non-blocking. Output is queued per client and written
+ * as the socket accepts it; a client whose queue is still draining gets its
+ * next frame only once it has caught up, and one that falls more than
+ * SERVER_MAX_QUEUE behind is dropped, so a stalled client never holds up
+ * the others. */
+
+void editorServerSend(int fd, int type, const void *payload, int len) {
+  unsigned char hdr[3] = { type, (len >> 8) & 0xff, len & 0xff };
+  if (write(fd, hdr, 3) != 3 || write(fd, payload, len) != len)
+    die("write");
+}
+
+void editorServerFlush(struct editorClient *cl) {
+  int pos = 0;
+  while (pos < cl->outlen && !cl->dead) {
+    ssize_t n = write(cl->fd, &cl->out[pos], cl->outlen - pos);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) cl->dead = 1;
+      break;
+    }
+    pos += n;
+  }
+  memmove(cl->out, &cl->out[pos], cl->outlen - pos);
+  cl->outlen -= pos;
+}
+
+void editorServerWrite(const char *s, int len) {
+  struct editorClient *cl = E.server.cur;
+  if (cl->dead) return;
+  if (cl->outlen + len > SERVER_MAX_QUEUE) {
+    cl->dead = 1;
+    return;
+  }
+  cl->out = realloc(cl->out, cl->outlen + len);
+  memcpy(&cl->out[cl->outlen], s, len);
+  cl->outlen += len;
+  editorServerFlush(cl);
+}
+
+void editorServerMessage(struct editorClient *cl, int type,
+                         unsigned char *payload, int len) {
+  if (type == SERVER_MSG_KEYS) {
+    if (cl->keypos == cl->nkeys) cl->keypos = cl->nkeys = 0;
+    cl->keys = realloc(cl->keys, cl->nkeys + len);
+    memcpy(&cl->keys[cl->nkeys], payload, len);
+    cl->nkeys += len;
+  } else if (type == SERVER_MSG_WINSIZE && len == 4) {
+    cl->screenrows = ((payload[0] << 8) | payload[1]) - 2;
+    cl->screencols = (payload[2] << 8) | payload[3];
+    if (cl->screenrows < 1) cl->screenrows = 1;
+    if (cl->screencols < 1) cl->screencols = 1;
+  }
+}
+
+/* Reads whatever the client has sent within `timeout` ms. Returns 1 if data
+ * arrived, 0 on timeout and -1 once the client is gone. */
+int editorServerFill(struct editorClient *cl, int timeout) {
+  if (cl->dead) return -1;
+
+  struct pollfd pfd = { cl->fd, POLLIN, 0 };
+  if (poll(&pfd, 1, timeout) <= 0) return 0;
+
+  unsigned char buf[4096];
+  ssize_t n = read(cl->fd, buf, sizeof(buf));
+  if (n == -1 && (errno == EAGAIN || errno == EINTR)) return 0;
+  if (n <= 0) {
+    cl->dead = 1;
+    return -1;
+  }
+  cl->idle = 0;
+
+  cl->msg = realloc(cl->msg, cl->msglen + n);
+  memcpy(&cl->msg[cl->msglen], buf, n);
+  cl->msglen += n;
+
+  int pos = 0;
+  while (cl->msglen - pos >= 3) {
+    int len = (cl->msg[pos + 1] << 8) | cl->msg[pos + 2];
+    if (cl->msglen - pos - 3 < len) break;
+    editorServerMessage(cl, cl->msg[pos], &cl->msg[pos + 3], len);
+    pos += 3 + len;
+  }
+  memmove(cl->msg, &cl->msg[pos], cl->msglen - pos);
+  cl->msglen -= pos;
+  return 1;
+}
+
+void editorServerAccept() {
+  int fd = accept(E.server.listenfd, NULL, NULL);
+  if (fd == -1) return;
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  struct editorClient *cl = calloc(1, sizeof(*cl));
+  cl->fd = fd;
+  cl->screenrows = KILO_HEADLESS_ROWS - 2;
+  cl->screencols = KILO_HEADLESS_COLS;
+  cl->stale = 1;
+  E.server.clients = realloc(E.server.clients,
+    sizeof(struct editorClient *) * (E.server.nclients + 1));
+  E.server.clients[E.server.nclients++] = cl;
+}
+
+/* Waits up to `timeout` ms for socket activity, then accepts new clients,
+ * buffers whatever clients sent and drains their output queues. */
+void editorServerPump(int timeout) {
+  int n = E.server.nclients;
+  struct pollfd *pfds = malloc(sizeof(struct pollfd) * (n + 1));
+  pfds[0].fd = E.server.listenfd;
+  pfds[0].events = POLLIN;
+  int i;
+  for (i = 0; i < n; i++) {
+    struct editorClient *cl = E.server.clients[i];
+    pfds[i + 1].fd = cl->fd;
+    pfds[i + 1].events = POLLIN | (cl->outlen ? POLLOUT : 0);
+  }
+  if (poll(pfds, n + 1, timeout) == -1) {
+    free(pfds);
+    if (errno == EINTR) return;
+    die("poll");
+  }
+
+  for (i = 0; i < n; i++) {
+    struct editorClient *cl = E.server.clients[i];
+    short rev = pfds[i + 1].revents;
+    if (rev & (POLLIN | POLLHUP | POLLERR)) {
+      if (editorServerFill(cl, 0) == 1 && cl->keypos == cl->nkeys)
+        cl->stale = 1;
+    }
+    if (rev & POLLOUT) editorServerFlush(cl);
+  }
+  if (pfds[0].revents & POLLIN) editorServerAccept();
+  free(pfds);
+}
+
+void editorServerSelect(struct editorClient *cl) {
+  E.server.cur = cl;
+  E.screenrows = cl->screenrows;
+  E.screencols = cl->screencols;
+  E.rowoff = cl->rowoff;
+  E.coloff = cl->coloff;
+}
+
+void editorServerDeselect() {
+  struct editorClient *cl = E.server.cur;
+  cl->rowoff = E.rowoff;
+  cl->coloff = E.coloff;
+  E.server.cur = NULL;
+}
+
+/* Sends pending frames to the clients other than the one whose keys are
+ * being processed, e.g. ones that attached while it sits in a prompt. */
+void editorServerRedrawOthers() {
+  struct editorClient *cur = E.server.cur;
+  for (int i = 0; i < E.server.nclients; i++) {
+    struct editorClient *cl = E.server.clients[i];
+    if (cl == cur || cl->dead || !cl->stale || cl->outlen) continue;
+    editorServerDeselect();
+    editorServerSelect(cl);
+    E.fullredraw = 1;
+    editorRefreshScreen();
+    editorServerDeselect();
+    editorServerSelect(cur);
+    E.fullredraw = 1;
+    cl->stale = 0;
+  }
+}
+
+/* Byte source for editorReadTerminalKey: the terminal, or the client whose
+ * keys are being processed. While the client is inside a prompt the other
+ * clients keep being serviced. A client that goes away, or leaves a prompt
+ * idle for SERVER_PROMPT_IDLE polls, reads as ESC so the prompt is
+ * cancelled and the rest can get their keys processed again. */
+int editorReadByte(char *c) {
+  struct editorClient *cl = E.server.cur;
+  if (cl == NULL) return read(STDIN_FILENO, c, 1);
+
+  if (cl->keypos == cl->nkeys && !cl->dead) {
+    editorServerPump(100);
+    editorServerRedrawOthers();
+  }
+  if (cl->dead || (cl->keypos == cl->nkeys &&
+                   ++cl->idle >= SERVER_PROMPT_IDLE)) {
+    cl->idle = 0;
+    *c = '\x1b';
+    return 1;
+  }
+  if (cl->keypos == cl->nkeys) return 0;
+  cl->idle = 0;
+  *c = cl->keys[cl->keypos++];
+  return 1;
+}
+
+
+void editorServerDrop(int i) {
+  struct editorClient *cl = E.server.clients[i];
+  close(cl->fd);
+  free(cl->msg);
+  free(cl->keys);
+  free(cl->out);
+  free(cl);
+  memmove(&E.server.clients[i], &E.server.clients[i + 1],
+          sizeof(struct editorClient *) * (E.server.nclients - i - 1));
+  E.server.nclients--;
+}
+
+void editorServerListen(const char *path) {
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    die("socket");
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  E.server.listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (E.server.listenfd == -1) die("socket");
+
+  /* only a stale socket left by a dead server may be replaced */
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      errno = EEXIST;
+      die(path);
+    }
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe == -1) die("socket");
+    int live = connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    close(probe);
+    if (live) {
+      errno = EADDRINUSE;
+      die(path);
+    }
+    if (unlink(path) == -1) die("unlink");
+  } else if (errno != ENOENT) {
+    die(path);
+  }
+  if (bind(E.server.listenfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    die("bind");
+  if (listen(E.server.listenfd, 16) == -1) die("listen");
+  E.server.active = 1;
+  signal(SIGPIPE, SIG_IGN);
+}
+
+void editorServerDaemonize() {
+  pid_t pid = fork();
+  if (pid == -1) die("fork");
+  if (pid > 0) exit(0);
+  setsid();
+
+  int fd = open("/dev/null", O_RDWR);
+  if (fd != -1) {
+    dup2(fd, STDIN_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    if (fd > STDERR_FILENO) close(fd);
+  }
+}
+
+void editorServe() {
+  int i;
+
+  while (1) {
+    editorServerPump(-1);
+
+    int changed = 0;
+    for (i = 0; i < E.server.nclients; i++) {
+      struct editorClient *cl = E.server.clients[i];
+      if (cl->dead || cl->keypos == cl->nkeys) continue;
+      editorServerSelect(cl);
+      while (!cl->dead && cl->keypos < cl->nkeys) editorProcessKeypress();
+      editorServerDeselect();
+      changed = 1;
+    }
+
+    for (i = E.server.nclients - 1; i >= 0; i--) {
+      if (E.server.clients[i]->dead) editorServerDrop(i);
+    }
+
+    for (i = 0; i < E.server.nclients; i++) {
+      struct editorClient *cl = E.server.clients[i];
+      if (changed) cl->stale = 1;
+      if (!cl->stale || cl->outlen) continue;
+      editorServerSelect(cl);
+      E.fullredraw = 1;
+      editorRefreshScreen();
+      editorServerDeselect();
+      cl->stale = 0;
+    }
+  }
+}
+
+void editorAttach(const char *path) {
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    die("socket");
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) die("socket");
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    die("connect");
+
+  enableRawMode();
+  editorWinchInit();
+
+  int rows, cols;
+  int resized = 1;
+  while (1) {
+    if (resized) {
+      if (getWindowSize(&rows, &cols) == -1) die("getWindowSize");
+      unsigned char ws[4] = { rows >> 8, rows & 0xff, cols >> 8, cols & 0xff };
+      editorServerSend(fd, SERVER_MSG_WINSIZE, ws, sizeof(ws));
+    }
+
+    struct pollfd pfds[3] = {
+      { STDIN_FILENO, POLLIN, 0 },
+      { fd, POLLIN, 0 },
+      { E.winchpipe[0], POLLIN, 0 }
+    };
+    if (poll(pfds, 3, -1) == -1) {
+      if (errno == EINTR) continue;
+      die("poll");
+    }
+    resized = (pfds[2].revents & POLLIN) && editorWinchPending();
+
+    char buf[4096];
+    ssize_t n;
+    if (pfds[0].revents & POLLIN) {
+      n = read(STDIN_FILENO, buf, sizeof(buf));
+      if (n > 0) editorServerSend(fd, SERVER_MSG_KEYS, buf, n);
+    }
+    if (pfds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+      n = read(fd, buf, sizeof(buf));
+      if (n <= 0) break;
+      write(STDOUT_FILENO, buf, n);
+    }
+  }
+
+  write(STDOUT_FILENO, "\x1b[2J", 4);
+  write(STDOUT_FILENO, "\x1b[H", 3);
+  exit(0);
+}
+
 /*** input ***/
 
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
@@ -880,9 +4694,13 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
   while (1) {
     editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+    editorFlushFrame();
 
     int c = editorReadKey();
+    if (c == RESIZE_EVENT) {
+      editorResize();
+      continue;
+    }
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
       if (buflen != 0) buf[--buflen] = '\0';
     } else if (c == '\x1b') {
@@ -953,13 +4771,24 @@ void editorProcessKeypress() {
 
   int c = editorReadKey();
 
+  if (c == RESIZE_EVENT) {
+    editorResize();
+    return;
+  }
+  if (E.results && editorGrepKey(c)) return;
+  if (E.hex.fd != -1 && editorHexKey(c)) return;
+
   switch (c) {
     case '\r':
       editorInsertNewline();
       break;
 
     case CTRL_KEY('q'):
-      if (E.dirty && quit_times > 0) {
+      if (E.server.cur) {
+        E.server.cur->dead = 1;
+        return;
+      }
+      if (editorBuffersDirty() && quit_times > 0) {
         editorSetStatusMessage("WARNING!!! File has unsaved changes. "
           "Press Ctrl-Q %d more times to quit.", quit_times);
         quit_times--;
@@ -987,6 +4816,50 @@ void editorProcessKeypress() {
       editorFind();
       break;
 
+    case CTRL_KEY('g'):
+      editorGoto();
+      break;
+
+    case CTRL_KEY('t'):
+      editorGrep();
+      break;
+
+    case CTRL_KEY('o'):
+      editorBufferPrompt();
+      break;
+
+    case CTRL_KEY('b'):
+      editorBufferNext();
+      break;
+
+    case CTRL_KEY('e'):
+      editorFilter();
+      break;
+
+    case CTRL_KEY('w'):
+      editorToggleWrap();
+      break;
+
+    case CTRL_KEY('a'):
+      editorToggleMatchAll();
+      break;
+
+    case CTRL_KEY('r'):
+      editorMacroToggle();
+      break;
+
+    case CTRL_KEY('p'):
+      editorMacroApply();
+      break;
+
+    case CTRL_KEY('k'):
+      editorMemReport();
+      break;
+
+    case CTRL_KEY('u'):
+      editorCompact();
+      break;
+
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
@@ -996,6 +4869,10 @@ void editorProcessKeypress() {
 
     case PAGE_UP:
     case PAGE_DOWN:
+      if (E.softwrap) {
+        editorWrapPage(c);
+        break;
+      }
       {
         if (c == PAGE_UP) {
           E.cy = E.rowoff;
@@ -1038,31 +4915,110 @@ void initEditor() {
   E.rowoff = 0;
   E.coloff = 0;
   E.numrows = 0;
+  E.rowcap = 0;
   E.row = NULL;
+  E.arena = NULL;
+  memset(&E.lineidx, 0, sizeof(E.lineidx));
   E.dirty = 0;
   E.filename = NULL;
+  E.file_size = -1;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
   E.syntax = NULL;
-
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+  E.results = NULL;
+  E.hex.fd = -1;
+  E.match_query = NULL;
+  E.match_all = 0;
+  E.match_gen = 1;
+  E.buffers = NULL;
+  E.nbuffers = 0;
+  E.curbuf = editorBufferAdd(NULL);
+  E.buffer_clock = 0;
+  E.mem_budget = KILO_MEM_BUDGET;
+  if (getenv("KILO_MEM_BUDGET"))
+    E.mem_budget = atoll(getenv("KILO_MEM_BUDGET")) << 20;
+  syntaxDBLoad(&E.syntaxdb);
+  editorThemeLoad();
+  E.fullredraw = 1;
+  E.softwrap = 0;
+  memset(&E.wrapidx, 0, sizeof(E.wrapidx));
+  E.wrapcols = 0;
+  E.vrowoff = -1;
+  E.winchpipe[0] = E.winchpipe[1] = -1;
+  if (!E.session.headless) editorWinchInit();
+
+  int fps = KILO_MAX_FPS;
+  if (getenv("KILO_FPS")) fps = atoi(getenv("KILO_FPS"));
+  E.frame_interval = fps > 0 ? 1000000 / fps : 0;
+
+  if (E.session.headless) {
+    E.screenrows = KILO_HEADLESS_ROWS;
+    E.screencols = KILO_HEADLESS_COLS;
+  } else if (getWindowSize(&E.screenrows, &E.screencols) == -1) {
+    die("getWindowSize");
+  }
   E.screenrows -= 2;
 }
 
 int main(int argc, char *argv[]) {
-  enableRawMode();
+  char **files = malloc(sizeof(char *) * argc);
+  int nfiles = 0;
+  char *record = NULL;
+  char *replay = NULL;
+  char *server = NULL;
+  int paced = 0;
+  int hex = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+      record = argv[++i];
+    } else if (!strcmp(argv[i], "--replay") && i + 1 < argc) {
+      replay = argv[++i];
+    } else if (!strcmp(argv[i], "--paced")) {
+      paced = 1;
+    } else if (!strcmp(argv[i], "--hex")) {
+      hex = 1;
+    } else if (!strcmp(argv[i], "--server") && i + 1 < argc) {
+      server = argv[++i];
+    } else if (!strcmp(argv[i], "--attach") && i + 1 < argc) {
+      editorAttach(argv[++i]);
+    } else {
+      files[nfiles++] = argv[i];
+    }
+  }
+
+  E.session.recfd = -1;
+  memset(&E.macro, 0, sizeof(E.macro));
+  if (replay) editorReplayStart(replay, paced);
+  else if (server) E.session.headless = 1;
+  else enableRawMode();
+  if (record) editorRecordStart(record);
+
   initEditor();
-  if (argc >= 2) {
-    editorOpen(argv[1]);
+  if (nfiles > 0) {
+    E.hex_force = hex;
+    editorOpen(files[0]);
+    E.hex_force = 0;
   }
+  for (int i = 1; i < nfiles; i++) {
+    int b = editorBufferAdd(files[i]);
+    E.buffers[b].hex_force = hex;
+  }
+  free(files);
 
   editorSetStatusMessage(
-    "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
-
-  while (1) {
-    editorRefreshScreen();
-    editorProcessKeypress();
+    "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-G = goto | "
+    "Ctrl-T = grep | Ctrl-O = open | Ctrl-B = next buffer | Ctrl-E = filter | "
+    "Ctrl-W = wrap | Ctrl-A = highlight all | Ctrl-R/Ctrl-P = record/apply "
+    "macro | Ctrl-K = memory | Ctrl-U = compact");
+
+  if (server) {
+    editorServerListen(server);
+    editorServerDaemonize();
+    editorServe();
   }
 
+  editorRunLoop();
+
   return 0;
 }